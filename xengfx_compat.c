@@ -32,6 +32,103 @@
 #include "xengfx_compat.h"
 #include "xengfx_reg.h"
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33))
+struct drm_pending_vblank_event *
+xengfx_create_vblank_event(struct drm_device *dev, struct drm_file *file_priv,
+                           u64 user_data)
+{
+        struct drm_pending_vblank_event *e;
+        unsigned long flags;
+
+        spin_lock_irqsave(&dev->event_lock, flags);
+        if (file_priv->event_space < sizeof (e->event)) {
+                spin_unlock_irqrestore(&dev->event_lock, flags);
+                return NULL;
+        }
+        file_priv->event_space -= sizeof (e->event);
+        spin_unlock_irqrestore(&dev->event_lock, flags);
+
+        e = kzalloc(sizeof (*e), GFP_KERNEL);
+        if (!e) {
+                spin_lock_irqsave(&dev->event_lock, flags);
+                file_priv->event_space += sizeof (e->event);
+                spin_unlock_irqrestore(&dev->event_lock, flags);
+                return NULL;
+        }
+
+        e->event.base.type = DRM_EVENT_FLIP_COMPLETE;
+        e->event.base.length = sizeof (e->event);
+        e->event.user_data = user_data;
+        e->base.event = &e->event.base;
+        e->base.file_priv = file_priv;
+        e->base.destroy = (void (*) (struct drm_pending_event *)) kfree;
+
+        return e;
+}
+
+void xengfx_destroy_vblank_event(struct drm_device *dev,
+                                 struct drm_pending_vblank_event *e)
+{
+        unsigned long flags;
+
+        spin_lock_irqsave(&dev->event_lock, flags);
+        e->base.file_priv->event_space += sizeof (e->event);
+        spin_unlock_irqrestore(&dev->event_lock, flags);
+
+        kfree(e);
+}
+
+/* Called with dev->event_lock held */
+void xengfx_send_vblank_event(struct drm_device *dev, int crtc,
+                              struct drm_pending_vblank_event *e)
+{
+        struct timeval now;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38))
+        e->event.sequence = drm_vblank_count_and_time(dev, crtc, &now);
+#else
+        do_gettimeofday(&now);
+        e->event.sequence = drm_vblank_count(dev, crtc);
+#endif
+        e->event.tv_sec = now.tv_sec;
+        e->event.tv_usec = now.tv_usec;
+
+        list_add_tail(&e->base.link, &e->base.file_priv->event_list);
+        wake_up_interruptible(&e->base.file_priv->event_wait);
+}
+#else
+/* Only the usual 4:3 and 16:10 sizes, drm_add_modes_noedid() isn't there */
+int xengfx_add_modes_noedid(struct drm_connector *connector, int hdisplay,
+                            int vdisplay)
+{
+        static const struct { int w, h; } sizes[] = {
+                { 640, 480 }, { 800, 600 }, { 1024, 768 }, { 1280, 800 },
+                { 1280, 1024 }, { 1440, 900 }, { 1680, 1050 }, { 1920, 1200 },
+        };
+        struct drm_display_mode *mode;
+        int count = 0;
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+                if (sizes[i].w > hdisplay || sizes[i].h > vdisplay)
+                        continue;
+
+                mode = drm_cvt_mode(connector->dev, sizes[i].w, sizes[i].h,
+                                    60, false, false, false);
+                if (!mode)
+                        continue;
+
+                if (sizes[i].w == XENGFX_DEFAULT_WIDTH &&
+                    sizes[i].h == XENGFX_DEFAULT_HEIGHT)
+                        mode->type |= DRM_MODE_TYPE_PREFERRED;
+                drm_mode_probed_add(connector, mode);
+                count++;
+        }
+
+        return count;
+}
+#endif
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,34))
 #else
 /* Basic check is EDID is valid, from Linux code */
@@ -77,7 +174,9 @@ void xengfx_output_poll_changed(struct drm_device *dev)
 {
         struct xengfx_private *dev_priv = dev->dev_private;
 
-        drm_fb_helper_hotplug_event(&dev_priv->fbdev->helper);
+        /* Hotplug events can come before fbdev is set up */
+        if (dev_priv->fbdev)
+                drm_fb_helper_hotplug_event(&dev_priv->fbdev->helper);
 }
 
 void xengfx_gem_object_release(struct drm_gem_object *gem_obj)
@@ -147,33 +246,56 @@ int xengfx_get_scanout_position(struct drm_device *dev, int crtc, int *vpos,
                                 int *hpos)
 {
 	struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
+        struct drm_display_mode *mode;
         u32 cur_scanline;
-        u32 vactive, vmax;
         int ret = 0;
 
-        /* FIXME: This code is probably very wrong */
+        if (xengfx_crtc == NULL)
+                return 0;
+
+        mode = &xengfx_crtc->drm_crtc.hwmode;
+        if (!mode->crtc_vtotal)
+                return 0; /* Not programmed yet */
 
-        cur_scanline = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, SCANLINE));
+        cur_scanline = xengfx_status_scanline(dev_priv, crtc);
         if (cur_scanline == 0xffffffff)
                 return 0; /* Unimplemented ? */
-        vactive = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, V_ACTIVE));
-        vmax = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, MAX_VERTICAL));
 
         /* No HW pixelcount register */
         *hpos = 0;
 
-        if (cur_scanline < (vactive + 1))
+        /*
+         * The scanline runs from 0 to vtotal - 1, vblank starting at
+         * vdisplay. Report vblank lines as negative, counting up to the
+         * first active line.
+         */
+        if (cur_scanline < mode->crtc_vdisplay)
                 *vpos = cur_scanline;
         else {
-                *vpos = cur_scanline - (vmax + 1);
+                *vpos = cur_scanline - mode->crtc_vtotal;
                 ret |= DRM_SCANOUTPOS_INVBL;
         }
 
-        /* Don't consider it accurate for now */
-        //ret |= DRM_SCANOUTPOS_ACCURATE;
+        ret |= DRM_SCANOUTPOS_ACCURATE;
 
         return DRM_SCANOUTPOS_VALID | ret;
 }
+
+int xengfx_get_vblank_timestamp(struct drm_device *dev, int crtc,
+                                int *max_error, struct timeval *vblank_time,
+			        unsigned flags)
+{
+	struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
+
+        if (xengfx_crtc == NULL)
+                return -EINVAL;
+
+        return drm_calc_vbltimestamp_from_scanoutpos(dev, crtc, max_error,
+                                                     vblank_time, flags,
+                                                     &xengfx_crtc->drm_crtc);
+}
 #endif
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39))
@@ -47,12 +47,50 @@ void xengfx_gem_object_release(struct drm_gem_object *gem_obj);
 
 #define DRM_CALLOC(a,b) \
     drm_malloc_ab(a, b);
+#define XENGFX_ADD_MODES_NOEDID(connector, w, h) \
+    drm_add_modes_noedid(connector, w, h)
+#define XENGFX_SET_PREFERRED_MODE(connector, w, h) \
+    drm_set_preferred_mode(connector, w, h)
 
 #else
 
 #define DRM_CALLOC(a,b) \
     drm_calloc_large(a, b);
 
+int xengfx_add_modes_noedid(struct drm_connector *connector, int hdisplay,
+                            int vdisplay);
+#define XENGFX_ADD_MODES_NOEDID(connector, w, h) \
+    xengfx_add_modes_noedid(connector, w, h)
+/* xengfx_add_modes_noedid() marks the default mode preferred itself */
+#define XENGFX_SET_PREFERRED_MODE(connector, w, h)
+
+#endif
+
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33))
+
+#define PAGE_FLIP_IMPLEMENTATION \
+  .page_flip = xengfx_crtc_page_flip,
+#define DIRTY_IMPLEMENTATION \
+  .dirty = xengfx_fb_dirty,
+
+struct drm_pending_vblank_event *
+xengfx_create_vblank_event(struct drm_device *dev, struct drm_file *file_priv,
+                           u64 user_data);
+void xengfx_destroy_vblank_event(struct drm_device *dev,
+                                 struct drm_pending_vblank_event *e);
+void xengfx_send_vblank_event(struct drm_device *dev, int crtc,
+                              struct drm_pending_vblank_event *e);
+
+#else
+
+#define PAGE_FLIP_IMPLEMENTATION
+#define DIRTY_IMPLEMENTATION
+
+#define xengfx_create_vblank_event(a,b,c) NULL
+#define xengfx_destroy_vblank_event(a,b) do { } while (0)
+#define xengfx_send_vblank_event(a,b,c) do { } while (0)
+
 #endif
 
 
@@ -62,12 +100,19 @@ void xengfx_gem_object_release(struct drm_gem_object *gem_obj);
   .unlocked_ioctl = drm_ioctl,
 #define READ_IMPLEMENTATION \
   .read = drm_read,
+#define XENGFX_FB_DIRTY_SIGNATURE \
+  xengfx_fb_dirty(struct drm_framebuffer *drm_fb, struct drm_file *file_priv, \
+      unsigned flags, unsigned color, struct drm_clip_rect *clips, \
+      unsigned num_clips)
 
 #else
 
 #define IOCTL_IMPLEMENTATION \
   .ioctl = drm_ioctl,
 #define READ_IMPLEMENTATION
+#define XENGFX_FB_DIRTY_SIGNATURE \
+  xengfx_fb_dirty(struct drm_framebuffer *drm_fb, unsigned flags, \
+      unsigned color, struct drm_clip_rect *clips, unsigned num_clips)
 
 #endif
 
@@ -96,6 +141,15 @@ void xengfx_output_poll_changed(struct drm_device *dev);
 
 #define DRM_KMS_HELPER_POLL_INIT(a) \
   drm_kms_helper_poll_init(a)
+#define DRM_KMS_HELPER_POLL_FINI(a) \
+  drm_kms_helper_poll_fini(a)
+#define XENGFX_CONNECTOR_SET_POLLED(connector) \
+  (connector)->polled = DRM_CONNECTOR_POLL_HPD
+#define XENGFX_HOTPLUG_EVENT(dev) \
+  do { \
+        drm_sysfs_hotplug_event(dev); \
+        xengfx_output_poll_changed(dev); \
+  } while (0)
 #define LLSEEK_IMPLEMENTATION \
   .llseek = noop_llseek,
 
@@ -124,6 +178,10 @@ int xengfx_fb_changed(struct drm_device *dev);
         .fb_changed = xengfx_fb_changed
 
 #define DRM_KMS_HELPER_POLL_INIT(a)
+#define DRM_KMS_HELPER_POLL_FINI(a)
+#define XENGFX_CONNECTOR_SET_POLLED(connector)
+#define XENGFX_HOTPLUG_EVENT(dev) \
+  drm_sysfs_hotplug_event(dev)
 #define LLSEEK_IMPLEMENTATION
 #define FB_PROBE_IMPLEMENTATION
 
@@ -177,15 +235,38 @@ int drm_gem_object_init(struct drm_device *dev,
                 return 0
 
 #define GET_SCANOUT_POSITION_IMPLEMENTATION \
-  .get_scanout_position = xengfx_get_scanout_position,
+  .get_scanout_position = xengfx_get_scanout_position, \
+  .get_vblank_timestamp = xengfx_get_vblank_timestamp,
 
 int xengfx_get_scanout_position(struct drm_device *dev, int crtc,
                                 int *vpos, int *hpos);
+int xengfx_get_vblank_timestamp(struct drm_device *dev, int crtc,
+                                int *max_error, struct timeval *vblank_time,
+                                unsigned flags);
+
+#define XENGFX_SET_TIMESTAMPING_MODE(crtc, mode)        \
+  do {                                                  \
+        (crtc)->hwmode = *(mode);                       \
+        drm_calc_timestamping_constants(crtc);          \
+  } while (0)
+#define XENGFX_SET_TIMESTAMPING_CLOCK(crtc, clk)        \
+  do {                                                  \
+        (crtc)->hwmode.clock = (clk);                   \
+        drm_calc_timestamping_constants(crtc);          \
+  } while (0)
+
+#define XENGFX_CONSOLE_LOCK() console_lock()
+#define XENGFX_CONSOLE_UNLOCK() console_unlock()
 
 #else
 
 #define CHECK_IF_POWER_STATE_IS_OFF
 #define GET_SCANOUT_POSITION_IMPLEMENTATION
+#define XENGFX_SET_TIMESTAMPING_MODE(crtc, mode)
+#define XENGFX_SET_TIMESTAMPING_CLOCK(crtc, clk)
+
+#define XENGFX_CONSOLE_LOCK() acquire_console_sem()
+#define XENGFX_CONSOLE_UNLOCK() release_console_sem()
 
 #endif
 
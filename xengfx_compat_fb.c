@@ -67,8 +67,8 @@ int xengfx_fb_probe(struct drm_device *dev,
 
         /*
          * Valid framebuffer format and pitch alignment parametters exist
-         * on a per-crtc basis. So just fixup some sane values here:
-         * 32 bits per pixel, 128 bytes pitch alignment.
+         * on a per-crtc basis. The console goes on every CRTC, so use
+         * 32 bits per pixel and the strictest pitch alignment.
          */
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35))
@@ -85,7 +85,8 @@ int xengfx_fb_probe(struct drm_device *dev,
         mode_cmd.depth = surface_depth;
 #endif
 
-        mode_cmd.pitch = ALIGN(mode_cmd.width * ((mode_cmd.bpp + 7) / 8), 128);
+        mode_cmd.pitch = xengfx_pitch_align(dev_priv,
+                                            mode_cmd.width * ((mode_cmd.bpp + 7) / 8));
 
         size = mode_cmd.pitch * mode_cmd.height;
         size = ALIGN(size, PAGE_SIZE);
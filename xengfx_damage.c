@@ -0,0 +1,131 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2011 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Julian Pidancet <julian.pidancet@gmail.com>
+ *
+ **************************************************************************/
+
+#include "drmP.h"
+#include "xengfx_drv.h"
+#include "xengfx_reg.h"
+
+/*
+ * Queue damage for a CRTC and ring the doorbell. A single trap covers all
+ * the rectangles, whatever their number.
+ */
+void xengfx_damage_push(struct xengfx_private *dev_priv, int crtc,
+                        struct drm_clip_rect *rects, int count)
+{
+        struct xgfx_damage_ring *ring = dev_priv->damage_ring;
+        unsigned long flags;
+        u32 prod, cons;
+        int i;
+
+        if (!ring)
+                return;
+
+        spin_lock_irqsave(&dev_priv->damage_lock, flags);
+
+        prod = ring->prod;
+        cons = ACCESS_ONCE(ring->cons);
+        if (prod - cons + count > XGFX_DAMAGE_RING_SIZE) {
+                ring->overflow = 1;
+        } else {
+                for (i = 0; i < count; i++) {
+                        struct xgfx_damage_rect *r;
+
+                        r = &ring->rect[(prod + i) % XGFX_DAMAGE_RING_SIZE];
+                        r->crtc = crtc;
+                        r->x1 = rects[i].x1;
+                        r->y1 = rects[i].y1;
+                        r->x2 = rects[i].x2;
+                        r->y2 = rects[i].y2;
+                }
+                /* Rectangles before the producer index */
+                wmb();
+                ring->prod = prod + count;
+        }
+
+        xengfx_mmio_write(dev_priv, XGFX_DAMAGE_DOORBELL, ring->prod);
+
+        spin_unlock_irqrestore(&dev_priv->damage_lock, flags);
+}
+
+int xengfx_damage_init(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        BUILD_BUG_ON(sizeof (struct xgfx_damage_ring) > PAGE_SIZE);
+        spin_lock_init(&dev_priv->damage_lock);
+
+        if (!(dev_priv->caps & XGFX_CAPS_DAMAGE_RING))
+                return 0;
+
+        dev_priv->damage_pg = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!dev_priv->damage_pg)
+                return -ENOMEM;
+
+        dev_priv->damage_ring = page_address(dev_priv->damage_pg);
+        xengfx_mmio_write(dev_priv, XGFX_DAMAGE_RING,
+                          page_to_pfn(dev_priv->damage_pg));
+
+        return 0;
+}
+
+/*
+ * The device forgets the ring across suspend. Start it over empty, with the
+ * overflow flag set so the host redraws everything.
+ */
+void xengfx_damage_resume(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xgfx_damage_ring *ring = dev_priv->damage_ring;
+        unsigned long flags;
+
+        if (!ring)
+                return;
+
+        spin_lock_irqsave(&dev_priv->damage_lock, flags);
+        ring->prod = 0;
+        ring->cons = 0;
+        ring->overflow = 1;
+        xengfx_mmio_write(dev_priv, XGFX_DAMAGE_RING,
+                          page_to_pfn(dev_priv->damage_pg));
+        spin_unlock_irqrestore(&dev_priv->damage_lock, flags);
+}
+
+void xengfx_damage_fini(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        if (!dev_priv->damage_ring)
+                return;
+
+        xengfx_mmio_write(dev_priv, XGFX_DAMAGE_RING, 0);
+
+        __free_page(dev_priv->damage_pg);
+        dev_priv->damage_pg = NULL;
+        dev_priv->damage_ring = NULL;
+}
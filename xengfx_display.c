@@ -27,6 +27,7 @@
  *
  **************************************************************************/
 
+#include <linux/crc32.h>
 #include "drmP.h"
 #include "xengfx_drv.h"
 #include "xengfx_reg.h"
@@ -34,6 +35,49 @@
 
 #include "drm_crtc_helper.h"
 
+#define XENGFX_EDID_TIMEOUT         msecs_to_jiffies(500)
+
+/*
+ * The device clears EDID_REQUEST once the EDID is ready. Sleep until the
+ * STATUS_EDID interrupt when there is one, poll gently otherwise. This still
+ * blocks the caller, get_modes, but rarely runs thanks to EDID_GENERATION.
+ */
+static int xengfx_edid_request(struct drm_device *dev, struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        unsigned long timeout = jiffies + XENGFX_EDID_TIMEOUT;
+
+        crtc->edid_pending = true;
+        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, EDID_REQUEST), 0x1);
+
+        if (dev->irq_enabled && (dev_priv->caps & XGFX_CAPS_EDID_INT)) {
+                if (wait_event_timeout(crtc->edid_wait,
+                                       !ACCESS_ONCE(crtc->edid_pending),
+                                       XENGFX_EDID_TIMEOUT))
+                        return 0;
+        }
+
+        for (;;) {
+                u32 v = xengfx_mmio_read(dev_priv,
+                                         XGFX_VCRTC(crtc_id, EDID_REQUEST));
+
+                if (!(v & 0x1))
+                        break;
+                if (time_after(jiffies, timeout))
+                        return -ETIMEDOUT;
+                msleep(1);
+        }
+
+        crtc->edid_pending = false;
+        return 0;
+}
+
+/*
+ * Returns the EDID of the display, fetched again only if the device reports
+ * a new generation. edid_changed is set when the contents differ from the
+ * previous EDID.
+ */
 struct edid *xengfx_get_edid(struct drm_connector *connector,
                              void *dummy)
 {
@@ -41,46 +85,191 @@ struct edid *xengfx_get_edid(struct drm_connector *connector,
         struct drm_device *dev = connector->dev;
         struct xengfx_private *dev_priv = dev->dev_private;
         int crtc_id = crtc->crtc_id;
-        u32 v;
+        u32 generation;
+        u32 crc;
         int i;
-        int timeout = 1000;
 
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, EDID_REQUEST),
-                          0x1);
-        /* Wait till EDID ready... XXX: Timeout ??? */
-        v = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id, EDID_REQUEST));
-        while ((v & 0x1) && --timeout) {
-                v = xengfx_mmio_read(dev_priv,
-                                     XGFX_VCRTC(crtc_id, EDID_REQUEST));
-        }
+        generation = xengfx_mmio_read(dev_priv,
+                                      XGFX_VCRTC(crtc_id, EDID_GENERATION));
+        if (crtc->edid_valid && generation != 0xffffffff &&
+            generation == crtc->edid_generation)
+                return (struct edid *)crtc->edid;
 
-        if (timeout <= 0)
+        if (xengfx_edid_request(dev, crtc)) {
+                DRM_ERROR("CRTC %d: EDID request timed out\n", crtc_id);
                 return NULL;
-
-        for (i = 0; i < XGFX_EDID_LEN; i += 4) {
-                v = xengfx_mmio_read(dev_priv,
-                                     XGFX_VCRTC(crtc_id, EDID) + i);
-                *(u32 *)(crtc->edid + i) = v;
         }
 
+        /* The device only emulates 32 bit reads of the EDID window */
+        for (i = 0; i < XGFX_EDID_LEN; i += 4)
+                *(u32 *)(crtc->edid + i) =
+                        xengfx_mmio_read(dev_priv,
+                                         XGFX_VCRTC(crtc_id, EDID) + i);
+
+        crc = crc32_le(~0, crtc->edid, XGFX_EDID_LEN);
+        if (!crtc->edid_valid || crc != crtc->edid_crc)
+                crtc->edid_changed = true;
+        crtc->edid_crc = crc;
+        crtc->edid_generation = generation;
+        crtc->edid_valid = EDID_IS_VALID((struct edid *)crtc->edid);
+
+        if (!crtc->edid_valid)
+                return NULL;
+
         return (struct edid *)crtc->edid;
 }
 
 /* Connector/Encoder part */
 
+static void xengfx_edid_modes_free(struct drm_device *dev,
+                                   struct xengfx_edid_modes *entry)
+{
+        struct drm_display_mode *mode, *t;
+
+        list_for_each_entry_safe(mode, t, &entry->modes, head) {
+                list_del(&mode->head);
+                drm_mode_destroy(dev, mode);
+        }
+        list_del(&entry->head);
+        kfree(entry);
+}
+
+static struct xengfx_edid_modes *
+xengfx_edid_modes_lookup(struct drm_device *dev, struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_edid_modes *entry;
+
+        list_for_each_entry(entry, &dev_priv->edid_modes, head) {
+                if (entry->crc == crtc->edid_crc &&
+                    !memcmp(entry->edid, crtc->edid, XGFX_EDID_LEN)) {
+                        /* Most recently used first */
+                        list_move(&entry->head, &dev_priv->edid_modes);
+                        return entry;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Remember the modes drm_add_edid_modes() just added after "last" in the
+ * probed list of the connector.
+ */
+static void xengfx_edid_modes_insert(struct drm_connector *connector,
+                                     struct list_head *last)
+{
+        struct xengfx_crtc *crtc = conn_to_xengfx_crtc(connector);
+        struct drm_device *dev = connector->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_edid_modes *entry;
+        struct drm_display_mode *mode, *dup;
+
+        entry = kzalloc(sizeof (*entry), GFP_KERNEL);
+        if (!entry)
+                return;
+
+        entry->crc = crtc->edid_crc;
+        memcpy(entry->edid, crtc->edid, XGFX_EDID_LEN);
+        entry->width_mm = connector->display_info.width_mm;
+        entry->height_mm = connector->display_info.height_mm;
+        INIT_LIST_HEAD(&entry->head);
+        INIT_LIST_HEAD(&entry->modes);
+
+        mode = list_entry(last->next, struct drm_display_mode, head);
+        list_for_each_entry_from(mode, &connector->probed_modes, head) {
+                dup = drm_mode_duplicate(dev, mode);
+                if (!dup) {
+                        xengfx_edid_modes_free(dev, entry);
+                        return;
+                }
+                list_add_tail(&dup->head, &entry->modes);
+        }
+
+        if (dev_priv->edid_modes_count == XENGFX_EDID_MODES_CACHE_SIZE) {
+                xengfx_edid_modes_free(dev,
+                                       list_entry(dev_priv->edid_modes.prev,
+                                                  struct xengfx_edid_modes,
+                                                  head));
+                dev_priv->edid_modes_count--;
+        }
+
+        list_add(&entry->head, &dev_priv->edid_modes);
+        dev_priv->edid_modes_count++;
+}
+
+static int xengfx_edid_modes_add(struct drm_connector *connector,
+                                 struct xengfx_edid_modes *entry)
+{
+        struct drm_device *dev = connector->dev;
+        struct drm_display_mode *mode, *dup;
+        int count = 0;
+
+        list_for_each_entry(mode, &entry->modes, head) {
+                dup = drm_mode_duplicate(dev, mode);
+                if (!dup)
+                        break;
+                drm_mode_probed_add(connector, dup);
+                count++;
+        }
+
+        connector->display_info.width_mm = entry->width_mm;
+        connector->display_info.height_mm = entry->height_mm;
+
+        return count;
+}
+
+static void xengfx_edid_modes_cleanup(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_edid_modes *entry, *t;
+
+        list_for_each_entry_safe(entry, t, &dev_priv->edid_modes, head)
+                xengfx_edid_modes_free(dev, entry);
+        dev_priv->edid_modes_count = 0;
+}
+
+/*
+ * Host window resizes cause frequent reprobes, often going back and forth
+ * between the same few EDIDs: only parse an EDID the first time it is seen.
+ * Called with the mode_config mutex held, or at load.
+ */
 static int xengfx_connector_get_modes(struct drm_connector *connector)
 {
         struct xengfx_crtc *crtc = conn_to_xengfx_crtc(connector);
-        struct edid *edid = (struct edid *)crtc->edid;
-        int count;
+        struct drm_device *dev = connector->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_edid_modes *entry;
+        struct list_head *last;
+        struct edid *edid;
+        int count = 0;
 
-        if (!EDID_IS_VALID(edid))
-                edid = xengfx_get_edid(connector, NULL);
+        edid = xengfx_get_edid(connector, NULL);
+        if (edid && crtc->edid_changed) {
+                drm_mode_connector_update_edid_property(connector, edid);
+                crtc->edid_changed = false;
+        }
 
-        count = drm_add_edid_modes(connector, edid);
+        if (edid) {
+                entry = xengfx_edid_modes_lookup(dev, crtc);
+                if (entry) {
+                        count = xengfx_edid_modes_add(connector, entry);
+                } else {
+                        last = connector->probed_modes.prev;
+                        count = drm_add_edid_modes(connector, edid);
+                        if (count)
+                                xengfx_edid_modes_insert(connector, last);
+                }
+        }
 
         if (!count) {
-                /* XXX: Fall back on hardcoded default mode here */
+                struct xengfx_crtc_regs *regs = xengfx_crtc_regs(dev_priv, crtc);
+
+                count = XENGFX_ADD_MODES_NOEDID(connector,
+                                                regs->max_horizontal + 1,
+                                                regs->max_vertical + 1);
+                XENGFX_SET_PREFERRED_MODE(connector, XENGFX_DEFAULT_WIDTH,
+                                          XENGFX_DEFAULT_HEIGHT);
         }
 
         return count;
@@ -92,12 +281,12 @@ static int xengfx_connector_mode_valid(struct drm_connector *connector,
         struct xengfx_crtc *crtc = conn_to_xengfx_crtc(connector);
         struct drm_device *dev = connector->dev;
         struct xengfx_private *dev_priv = dev->dev_private;
-        int crtc_id = crtc->crtc_id;
+        struct xengfx_crtc_regs *regs = xengfx_crtc_regs(dev_priv, crtc);
         u32 maxh;
         u32 maxv;
 
-        maxh = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id, MAX_HORIZONTAL));
-        maxv = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id, MAX_VERTICAL));
+        maxh = regs->max_horizontal;
+        maxv = regs->max_vertical;
         maxh++;
         maxv++;
 
@@ -181,12 +370,6 @@ static const struct drm_connector_helper_funcs xengfx_connector_helper_funcs = {
         .best_encoder = xengfx_connector_best_encoder
 };
 
-static const struct drm_connector_funcs xengfx_connector_funcs = {
-        .detect = xengfx_connector_detect,
-        .fill_modes = drm_helper_probe_single_connector_modes,
-        .destroy = xengfx_connector_destroy,
-};
-
 static const struct drm_encoder_helper_funcs xengfx_encoder_helper_funcs = {
         .dpms = xengfx_encoder_dpms,
         .mode_fixup = xengfx_encoder_mode_fixup,
@@ -199,6 +382,148 @@ static const struct drm_encoder_funcs xengfx_encoder_funcs = {
         .destroy = xengfx_encoder_destroy,
 };
 
+/* Register shadow part */
+
+/* What a device predating VALID_FORMAT scans out */
+#define XENGFX_LEGACY_FORMATS   (XGFX_FORMAT_BGR555 | XGFX_FORMAT_BGR565 | \
+                                 XGFX_FORMAT_BGR888 | XGFX_FORMAT_BGR8888)
+/* and the pitch alignment it was always given */
+#define XENGFX_LEGACY_STRIDE_ALIGNMENT  127
+
+void xengfx_crtc_regs_fetch(struct xengfx_private *dev_priv,
+                            struct xengfx_crtc *crtc)
+{
+        struct xengfx_crtc_regs *regs = &crtc->regs;
+        int crtc_id = crtc->crtc_id;
+
+        regs->max_horizontal = xengfx_mmio_read(dev_priv,
+                                                XGFX_VCRTC(crtc_id, MAX_HORIZONTAL));
+        regs->max_vertical = xengfx_mmio_read(dev_priv,
+                                              XGFX_VCRTC(crtc_id, MAX_VERTICAL));
+        regs->stride_alignment = xengfx_mmio_read(dev_priv,
+                                                  XGFX_VCRTC(crtc_id, STRIDE_ALIGNMENT));
+        if (regs->stride_alignment == ~0U)
+                regs->stride_alignment = XENGFX_LEGACY_STRIDE_ALIGNMENT;
+        regs->valid_format = xengfx_mmio_read(dev_priv,
+                                              XGFX_VCRTC(crtc_id, VALID_FORMAT));
+        if (!regs->valid_format || regs->valid_format == ~0U)
+                regs->valid_format = XENGFX_LEGACY_FORMATS;
+        regs->valid = true;
+}
+
+/* Forget everything we know about the device state, e.g. after a reset */
+void xengfx_crtc_regs_reset(struct xengfx_crtc *crtc)
+{
+        struct xengfx_crtc_regs *regs = &crtc->regs;
+
+        regs->valid = false;
+        regs->h_active = ~0;
+        regs->v_active = ~0;
+        regs->format = ~0;
+        regs->stride = ~0;
+        regs->h_total = ~0;
+        regs->h_sync_start = ~0;
+        regs->h_sync_end = ~0;
+        regs->v_total = ~0;
+        regs->v_sync_start = ~0;
+        regs->v_sync_end = ~0;
+        regs->pixel_clock = ~0;
+        regs->refresh = ~0;
+        regs->source_size = ~0;
+        regs->scaling = ~0;
+        regs->uv_stride = ~0;
+        regs->lineoffset = ~0;
+}
+
+/* Page flip part */
+
+static void xengfx_flip_work_func(struct work_struct *work)
+{
+        struct xengfx_flip *flip = container_of(work, struct xengfx_flip, work);
+        struct drm_device *dev = flip->dev;
+
+        mutex_lock(&dev->struct_mutex);
+        xengfx_gem_object_unpin(flip->old_obj);
+        drm_gem_object_unreference(&flip->old_obj->gem_object);
+        mutex_unlock(&dev->struct_mutex);
+
+        kfree(flip);
+}
+
+/*
+ * Release what a retired flip was holding. The previous scanout buffer can
+ * only be unpinned with struct_mutex held, which we can't take from the
+ * retrace interrupt.
+ */
+static void xengfx_flip_release(struct xengfx_crtc *crtc,
+                                struct xengfx_flip *flip)
+{
+        drm_vblank_put(crtc->drm_crtc.dev, crtc->crtc_id);
+        schedule_work(&flip->work);
+}
+
+/*
+ * A retrace that the device signalled but that wasn't counted yet happened
+ * before anything written now. A retrace on its own MSI-X vector is counted
+ * by the hard interrupt handler straight away.
+ */
+static bool xengfx_crtc_retrace_pending(struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        u32 change;
+
+        if (!(crtc->regs.status_int & XGFX_VCRTC_STATUS_RETRACE))
+                return false;
+
+        if (dev_priv->status_page)
+                change = ACCESS_ONCE(dev_priv->status_page->crtc[crtc_id].change);
+        else
+                change = xengfx_mmio_read(dev_priv,
+                                          XGFX_VCRTC(crtc_id, STATUS_CHANGE));
+
+        return change & XGFX_VCRTC_STATUS_RETRACE;
+}
+
+/* Whether a retrace went by since the base of the flip was written */
+static bool xengfx_flip_latched(struct xengfx_crtc *crtc,
+                                struct xengfx_flip *flip)
+{
+        return (s32)(ACCESS_ONCE(crtc->retrace_count) - flip->retrace_seq) > 0;
+}
+
+static void xengfx_crtc_complete_flip(struct xengfx_crtc *crtc, bool force)
+{
+        struct drm_device *dev = crtc->drm_crtc.dev;
+        struct xengfx_flip *flip;
+        unsigned long flags;
+
+        spin_lock_irqsave(&dev->event_lock, flags);
+        flip = crtc->flip;
+        if (flip && !force && !xengfx_flip_latched(crtc, flip))
+                flip = NULL;
+        if (flip) {
+                crtc->flip = NULL;
+                if (flip->event)
+                        xengfx_send_vblank_event(dev, crtc->crtc_id,
+                                                 flip->event);
+        }
+        spin_unlock_irqrestore(&dev->event_lock, flags);
+
+        if (flip)
+                xengfx_flip_release(crtc, flip);
+}
+
+/*
+ * Complete the pending flip of a CRTC, if any. This is called at retrace
+ * since the device latches the new base at that time, but only a retrace
+ * after the base was written completes the flip.
+ */
+void xengfx_crtc_finish_flip(struct xengfx_crtc *crtc)
+{
+        xengfx_crtc_complete_flip(crtc, false);
+}
+
 /* CRTC part */
 
 static void xengfx_crtc_disable(struct drm_crtc *drm_crtc)
@@ -211,6 +536,8 @@ static void xengfx_crtc_disable(struct drm_crtc *drm_crtc)
         if (!crtc->active)
                 return;
 
+        /* Nothing is scanned out anymore */
+        xengfx_crtc_complete_flip(crtc, true);
         drm_vblank_off(dev, crtc_id);
 
         xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, CONTROL), 0);
@@ -229,11 +556,14 @@ static void xengfx_crtc_disable(struct drm_crtc *drm_crtc)
         crtc->active = false;
 }
 
+/*
+ * The mode and framebuffer staged while the CRTC was disabled are committed
+ * together with CONTROL and the base, so the device never runs a half
+ * programmed CRTC. A disabled CRTC applies the block at once.
+ */
 static void xengfx_crtc_enable(struct drm_crtc *drm_crtc)
 {
         struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
-        struct drm_device *dev = drm_crtc->dev;
-        struct xengfx_private *dev_priv = dev->dev_private;
         int crtc_id = crtc->crtc_id;
 
         if (crtc->active)
@@ -241,10 +571,15 @@ static void xengfx_crtc_enable(struct drm_crtc *drm_crtc)
 
         crtc->active = true;
 
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, CONTROL), 1);
+        xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, CONTROL), 1);
 
         /* Post */
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, BASE), crtc->base);
+        if (crtc->regs.format == XGFX_FORMAT_NV12)
+                xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, UV_BASE),
+                                        crtc->uv_base);
+        xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, BASE), crtc->base);
+        xengfx_crtc_flush(crtc);
+        xengfx_crtc_frame_done(crtc);
 }
 
 static void xengfx_crtc_prepare(struct drm_crtc *drm_crtc)
@@ -280,220 +615,1196 @@ static bool xengfx_crtc_mode_fixup(struct drm_crtc *drm_crtc,
         return true;
 }
 
-static int
-xengfx_crtc_set_base(struct drm_crtc *drm_crtc, int x, int y,
-                     struct drm_framebuffer *old_fb)
+static int xengfx_fb_format(struct drm_framebuffer *drm_fb, u32 *format)
 {
-        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
-        struct drm_device *dev = drm_crtc->dev;
-        struct xengfx_private *dev_priv = dev->dev_private;
-        int crtc_id = crtc->crtc_id;
-        struct xengfx_framebuffer *fb;
-        struct xengfx_gem_object *obj;
-        int ret;
-        u32 format;
-        u32 base;
-        u32 stride;
-        u32 align;
+        struct xengfx_framebuffer *fb = to_xengfx_fb(drm_fb);
 
-        if (!drm_crtc->fb) {
+        if (fb->format) {
+                *format = fb->format;
                 return 0;
         }
-        fb = to_xengfx_fb(drm_crtc->fb);
-
-        stride = fb->drm_fb.pitch;
 
         /* Framebuffer format is BGR by default ? */
-        switch (fb->drm_fb.bits_per_pixel) {
+        switch (drm_fb->bits_per_pixel) {
         case 15:
-                format = XGFX_FORMAT_BGR555;
+                *format = XGFX_FORMAT_BGR555;
                 break;
         case 16:
-                format = XGFX_FORMAT_BGR565;
+                *format = XGFX_FORMAT_BGR565;
                 break;
         case 24:
-                format = XGFX_FORMAT_BGR888;
+                *format = XGFX_FORMAT_BGR888;
                 break;
         case 32:
-                format = XGFX_FORMAT_BGR8888;
+                *format = XGFX_FORMAT_BGR8888;
                 break;
         default:
                 return -EINVAL;
         }
 
-        obj = fb->obj;
-        if (!fb->obj)
-                return -EINVAL;
-
-        mutex_lock(&dev->struct_mutex);
+        return 0;
+}
 
-        ret = xengfx_gem_object_pin(obj);
-        if (ret) {
-                mutex_unlock(&dev->struct_mutex);
-                return ret;
+/* All the formats with bpp bits per pixel */
+static u32 xengfx_bpp_formats(u32 bpp)
+{
+        switch (bpp) {
+        case 8:
+                return XGFX_FORMAT_NV12;
+        case 15:
+                return XGFX_FORMAT_RGB555 | XGFX_FORMAT_BGR555;
+        case 16:
+                return XGFX_FORMAT_RGB565 | XGFX_FORMAT_BGR565 |
+                       XGFX_FORMAT_YUYV;
+        case 24:
+                return XGFX_FORMAT_RGB888 | XGFX_FORMAT_BGR888;
+        case 32:
+                return XGFX_FORMAT_RGB8888 | XGFX_FORMAT_BGR8888;
+        default:
+                return 0;
         }
+}
 
-        if (old_fb) {
-                struct xengfx_gem_object *old_obj = to_xengfx_fb(old_fb)->obj;
+int xengfx_bpp_valid(struct xengfx_crtc *crtc, u32 bpp)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
 
-                xengfx_gem_object_unpin(old_obj);
-        }
+        return !!(xengfx_crtc_regs(dev_priv, crtc)->valid_format &
+                  xengfx_bpp_formats(bpp));
+}
 
-        base = obj->offset;
-        base += x * ((fb->drm_fb.bits_per_pixel + 7) / 8) + y * fb->drm_fb.pitch;
+/* STRIDE_ALIGNMENT is a mask of the low bits that have to be clear */
+u32 xengfx_stride_align(struct xengfx_crtc *crtc, u32 stride)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        u32 mask = xengfx_crtc_regs(dev_priv, crtc)->stride_alignment;
 
-        /* Ultimately check base and stride alignment */
-        align = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id, STRIDE_ALIGNMENT));
-        if ((stride & align) || (base & align)) {
-                xengfx_gem_object_unpin(obj);
-                mutex_unlock(&dev->struct_mutex);
+        return (stride + mask) & ~mask;
+}
 
-                return -EINVAL;
+/*
+ * Align a pitch for every CRTC, so that a buffer can be scanned out from
+ * whichever CRTC it ends up on.
+ */
+u32 xengfx_pitch_align(struct xengfx_private *dev_priv, u32 stride)
+{
+        u32 mask = 0;
+        int i;
+
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                struct xengfx_crtc *crtc = dev_priv->crtcs[i];
+
+                if (crtc)
+                        mask |= xengfx_crtc_regs(dev_priv, crtc)->stride_alignment;
         }
 
-        mutex_unlock(&dev->struct_mutex);
+        return (stride + mask) & ~mask;
+}
 
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, FORMAT), format);
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, STRIDE), stride);
+int xengfx_stride_valid(struct xengfx_crtc *crtc, u32 stride)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
 
+        return !(stride & xengfx_crtc_regs(dev_priv, crtc)->stride_alignment);
+}
 
-        /*
-         * Posted write to the CRTC base register is done in xengfx_crtc_commit,
-         * it will then push down all the parameters to the HW.
-         */
-        crtc->base = base;
+/*
+ * Offsets in the buffer object of the planes scanned out from x, y, and
+ * stride of the UV plane. Chroma is subsampled horizontally in YUV formats,
+ * x is rounded down to a pixel pair. When the device takes x, y in
+ * LINEOFFSET, the planes start at the origin of the framebuffer.
+ */
+static void xengfx_fb_scanout(struct drm_framebuffer *drm_fb, int x, int y,
+                              u32 *offset, u32 *uv_offset, u32 *uv_stride)
+{
+        struct xengfx_private *dev_priv = drm_fb->dev->dev_private;
+        struct xengfx_framebuffer *fb = to_xengfx_fb(drm_fb);
 
-        /* If crtc is already active, we have to rewrite its base */
-        if (crtc->active)
-            xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, BASE), crtc->base);
+        if (dev_priv->caps & XGFX_CAPS_LINEOFFSET)
+                x = y = 0;
 
-        return 0;
+        *uv_offset = 0;
+        *uv_stride = 0;
+
+        switch (fb->format) {
+        case XGFX_FORMAT_YUYV:
+                *offset = fb->offsets[0] + (x & ~1) * 2 + y * fb->pitches[0];
+                break;
+        case XGFX_FORMAT_NV12:
+                *offset = fb->offsets[0] + x + y * fb->pitches[0];
+                *uv_offset = fb->offsets[1] + (x & ~1) + (y / 2) * fb->pitches[1];
+                *uv_stride = fb->pitches[1];
+                break;
+        default:
+                *offset = x * ((drm_fb->bits_per_pixel + 7) / 8) +
+                          y * drm_fb->pitch;
+                break;
+        }
 }
 
+/*
+ * The scanned out area is the part of the framebuffer from x, y that fits
+ * the mode. It is only smaller than the mode when the device scales it.
+ */
+static void xengfx_crtc_source_size(struct xengfx_crtc *crtc,
+                                    struct drm_framebuffer *drm_fb, int x, int y,
+                                    u32 *width, u32 *height)
+{
+        struct drm_display_mode *mode = &crtc->drm_crtc.mode;
+
+        x = clamp_t(int, x, 0, drm_fb->width);
+        y = clamp_t(int, y, 0, drm_fb->height);
+        *width = min_t(u32, drm_fb->width - x, mode->hdisplay);
+        *height = min_t(u32, drm_fb->height - y, mode->vdisplay);
+}
 
-static int
-xengfx_crtc_mode_set(struct drm_crtc *drm_crtc, struct drm_display_mode *mode,
-		     struct drm_display_mode *adjusted_mode, int x, int y,
-		     struct drm_framebuffer *old_fb)
+static void xengfx_crtc_set_source(struct xengfx_crtc *crtc,
+                                   struct drm_framebuffer *drm_fb, int x, int y)
 {
-        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
-        struct drm_device *dev = drm_crtc->dev;
-        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
         int crtc_id = crtc->crtc_id;
-        int ret;
-
-        drm_vblank_pre_modeset(dev, crtc_id);
+        u32 width, height;
+        u32 size;
 
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, H_ACTIVE),
-                          adjusted_mode->crtc_hdisplay - 1);
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, V_ACTIVE),
-                          adjusted_mode->crtc_vdisplay - 1);
+        if (!(dev_priv->caps & XGFX_CAPS_SCALING))
+                return;
 
-        ret = xengfx_crtc_set_base(drm_crtc, x, y, old_fb);
-        drm_vblank_post_modeset(dev, crtc_id);
+        xengfx_crtc_source_size(crtc, drm_fb, x, y, &width, &height);
+        size = ((width - 1) << XGFX_VCRTC_SOURCE_SIZE_X_SHIFT) &
+               XGFX_VCRTC_SOURCE_SIZE_X_MASK;
+        size |= ((height - 1) << XGFX_VCRTC_SOURCE_SIZE_Y_SHIFT) &
+                XGFX_VCRTC_SOURCE_SIZE_Y_MASK;
 
-        return ret;
+        xengfx_crtc_stage(crtc, &crtc->regs.scaling,
+                          XGFX_VCRTC(crtc_id, SCALING), crtc->scaling);
+        xengfx_crtc_stage(crtc, &crtc->regs.source_size,
+                          XGFX_VCRTC(crtc_id, SOURCE_SIZE), size);
 }
 
-static void xengfx_crtc_load_lut(struct drm_crtc *crtc)
+/*
+ * Move the scanned out area within the framebuffer, see XGFX_CAPS_LINEOFFSET.
+ * Returns whether it moved.
+ */
+static bool xengfx_crtc_set_lineoffset(struct xengfx_crtc *crtc, int x, int y)
 {
-}
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        u32 lineoffset;
 
+        lineoffset = ((u32)x << XGFX_VCRTC_LINEOFFSET_X_SHIFT) &
+                     XGFX_VCRTC_LINEOFFSET_X_MASK;
+        lineoffset |= ((u32)y << XGFX_VCRTC_LINEOFFSET_Y_SHIFT) &
+                      XGFX_VCRTC_LINEOFFSET_Y_MASK;
 
-static int
-xengfx_crtc_cursor_set(struct drm_crtc *crtc, struct drm_file *file, uint32_t handle,
-                       uint32_t width, uint32_t height)
-{
-        // FIXME
-        return 0;
-}
+        if (!(dev_priv->caps & XGFX_CAPS_LINEOFFSET) ||
+            crtc->regs.lineoffset == lineoffset)
+                return false;
 
+        xengfx_crtc_stage(crtc, &crtc->regs.lineoffset,
+                          XGFX_VCRTC(crtc->crtc_id, LINEOFFSET), lineoffset);
+        return true;
+}
 
-static int
-xengfx_crtc_cursor_move(struct drm_crtc *crtc, int x, int y)
+/*
+ * The viewport at x, y must lie within the framebuffer and, unless the device
+ * scales, cover the mode.
+ */
+static int xengfx_crtc_check_viewport(struct xengfx_crtc *crtc,
+                                      struct drm_framebuffer *drm_fb,
+                                      struct drm_display_mode *mode,
+                                      int x, int y)
 {
-        // FIXME
-        return 0;
-}
+        if (x < 0 || y < 0 || x >= drm_fb->width || y >= drm_fb->height)
+                return -ENOSPC;
 
+        if (crtc->scaling == XGFX_SCALING_NONE &&
+            (x + mode->hdisplay > drm_fb->width ||
+             y + mode->vdisplay > drm_fb->height))
+                return -ENOSPC;
 
-static void
-XENGFX_CRTC_GAMMA_SET_SIGNATURE
-{
-        /* I doubt we are going to implement this */
+        return 0;
 }
 
-static void xengfx_crtc_destroy(struct drm_crtc *drm_crtc)
+/*
+ * Check that a CRTC configuration would be accepted by xengfx_crtc_mode_set()
+ * without touching the device. Base alignment can only be checked relative
+ * to the buffer object here, its offset in the GART is page aligned anyway.
+ */
+static int xengfx_crtc_check(struct xengfx_crtc *crtc,
+                             struct drm_framebuffer *drm_fb,
+                             struct drm_display_mode *mode, int x, int y)
 {
-        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
-        struct drm_device *dev = drm_crtc->dev;
+        struct drm_device *dev = crtc->drm_crtc.dev;
         struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_crtc_regs *regs;
+        u32 format;
+        u32 offset, uv_offset, uv_stride;
+        u32 align;
+        int ret;
 
-        drm_crtc_cleanup(drm_crtc);
+        if (!drm_fb)
+                return 0;
+
+        if (!to_xengfx_fb(drm_fb)->obj)
+                return -EINVAL;
+
+        if (mode->hdisplay <= 0 || mode->vdisplay <= 0)
+                return -EINVAL;
+
+        if (xengfx_connector_mode_valid(&crtc->connector, mode) != MODE_OK)
+                return -EINVAL;
+
+        ret = xengfx_crtc_check_viewport(crtc, drm_fb, mode, x, y);
+        if (ret)
+                return ret;
+
+        ret = xengfx_fb_format(drm_fb, &format);
+        if (ret)
+                return ret;
+
+        regs = xengfx_crtc_regs(dev_priv, crtc);
+        if (!(regs->valid_format & format))
+                return -EINVAL;
+
+        xengfx_fb_scanout(drm_fb, x, y, &offset, &uv_offset, &uv_stride);
+
+        align = regs->stride_alignment;
+        if ((drm_fb->pitch & align) || (offset & align) ||
+            (uv_stride & align) || (uv_offset & align))
+                return -EINVAL;
+
+        return 0;
+}
+
+static int
+xengfx_crtc_set_base(struct drm_crtc *drm_crtc, int x, int y,
+                     struct drm_framebuffer *old_fb)
+{
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct drm_device *dev = drm_crtc->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        struct xengfx_framebuffer *fb;
+        struct xengfx_gem_object *obj;
+        int ret;
+        u32 format;
+        u32 base, uv_base;
+        u32 stride, uv_stride;
+        u32 align;
+        bool moved;
+
+        if (!drm_crtc->fb) {
+                return 0;
+        }
+        fb = to_xengfx_fb(drm_crtc->fb);
+
+        /*
+         * Panning the framebuffer already scanned out, e.g. from fbdev
+         * pan_display, only moves the scanned out area: the buffer is
+         * pinned and its layout was checked when it was set.
+         */
+        if ((dev_priv->caps & XGFX_CAPS_LINEOFFSET) && crtc->active &&
+            old_fb == drm_crtc->fb) {
+                xengfx_crtc_set_source(crtc, &fb->drm_fb, x, y);
+                moved = xengfx_crtc_set_lineoffset(crtc, x, y);
+                xengfx_crtc_flush(crtc);
+                if (moved)
+                        xengfx_crtc_frame_done(crtc);
+                return 0;
+        }
+
+        stride = fb->drm_fb.pitch;
+
+        ret = xengfx_fb_format(&fb->drm_fb, &format);
+        if (ret)
+                return ret;
+        if (!(xengfx_crtc_regs(dev_priv, crtc)->valid_format & format))
+                return -EINVAL;
+
+        obj = fb->obj;
+        if (!fb->obj)
+                return -EINVAL;
+
+        mutex_lock(&dev->struct_mutex);
+
+        ret = xengfx_gem_object_pin(obj);
+        if (ret) {
+                mutex_unlock(&dev->struct_mutex);
+                return ret;
+        }
+
+        if (old_fb) {
+                struct xengfx_gem_object *old_obj = to_xengfx_fb(old_fb)->obj;
+
+                xengfx_gem_object_unpin(old_obj);
+        }
+
+        xengfx_fb_scanout(&fb->drm_fb, x, y, &base, &uv_base, &uv_stride);
+        base += obj->offset;
+        uv_base += obj->offset;
+
+        /* Ultimately check base and stride alignment */
+        align = xengfx_crtc_regs(dev_priv, crtc)->stride_alignment;
+        if ((stride & align) || (base & align) ||
+            (uv_stride & align) || (uv_base & align)) {
+                xengfx_gem_object_unpin(obj);
+                mutex_unlock(&dev->struct_mutex);
+
+                return -EINVAL;
+        }
+
+        mutex_unlock(&dev->struct_mutex);
+
+        xengfx_crtc_stage(crtc, &crtc->regs.format,
+                          XGFX_VCRTC(crtc_id, FORMAT), format);
+        xengfx_crtc_stage(crtc, &crtc->regs.stride,
+                          XGFX_VCRTC(crtc_id, STRIDE), stride);
+        if (format == XGFX_FORMAT_NV12)
+                xengfx_crtc_stage(crtc, &crtc->regs.uv_stride,
+                                  XGFX_VCRTC(crtc_id, UV_STRIDE), uv_stride);
+        xengfx_crtc_set_source(crtc, &fb->drm_fb, x, y);
+        moved = xengfx_crtc_set_lineoffset(crtc, x, y);
+
+        /*
+         * Posted write to the CRTC base register is done in xengfx_crtc_commit,
+         * it will then push down all the parameters to the HW.
+         */
+        if (crtc->base == base && crtc->uv_base == uv_base) {
+                if (crtc->active) {
+                        xengfx_crtc_flush(crtc);
+                        if (moved)
+                                xengfx_crtc_frame_done(crtc);
+                }
+                return 0;
+        }
+        crtc->base = base;
+        crtc->uv_base = uv_base;
+
+        /* If crtc is already active, we have to rewrite its base */
+        if (crtc->active) {
+            if (format == XGFX_FORMAT_NV12)
+                    xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, UV_BASE),
+                                            crtc->uv_base);
+            xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, BASE),
+                                    crtc->base);
+            xengfx_crtc_flush(crtc);
+            xengfx_crtc_frame_done(crtc);
+        }
+
+        return 0;
+}
+
+static u64 xengfx_mode_frame_ns(struct drm_display_mode *mode)
+{
+        if (!mode->clock || !mode->crtc_htotal || !mode->crtc_vtotal)
+                return NSEC_PER_SEC / 60;
+
+        /* clock is in kHz */
+        return div_u64((u64)mode->crtc_htotal * mode->crtc_vtotal * 1000000,
+                       mode->clock);
+}
+
+static void xengfx_crtc_set_timings(struct xengfx_private *dev_priv,
+                                    struct xengfx_crtc *crtc,
+                                    struct drm_display_mode *mode)
+{
+        struct xengfx_crtc_regs *regs = &crtc->regs;
+        int crtc_id = crtc->crtc_id;
+
+        if (!(dev_priv->caps & XGFX_CAPS_TIMINGS))
+                return;
+
+        xengfx_crtc_stage(crtc, &regs->h_total,
+                          XGFX_VCRTC(crtc_id, H_TOTAL), mode->crtc_htotal - 1);
+        xengfx_crtc_stage(crtc, &regs->h_sync_start,
+                          XGFX_VCRTC(crtc_id, H_SYNC_START),
+                          mode->crtc_hsync_start);
+        xengfx_crtc_stage(crtc, &regs->h_sync_end,
+                          XGFX_VCRTC(crtc_id, H_SYNC_END), mode->crtc_hsync_end);
+        xengfx_crtc_stage(crtc, &regs->v_total,
+                          XGFX_VCRTC(crtc_id, V_TOTAL), mode->crtc_vtotal - 1);
+        xengfx_crtc_stage(crtc, &regs->v_sync_start,
+                          XGFX_VCRTC(crtc_id, V_SYNC_START),
+                          mode->crtc_vsync_start);
+        xengfx_crtc_stage(crtc, &regs->v_sync_end,
+                          XGFX_VCRTC(crtc_id, V_SYNC_END), mode->crtc_vsync_end);
+        xengfx_crtc_stage(crtc, &regs->pixel_clock,
+                          XGFX_VCRTC(crtc_id, PIXEL_CLOCK), mode->clock);
+}
+
+/*
+ * Userspace may ask for a lower rate than the mode's through the refresh
+ * property, e.g. for a background head. The host scans out at that rate
+ * and vblanks follow it: the timestamping constants use a clock slowed
+ * down to match, and the vblank timer is restarted with the new period.
+ */
+static void xengfx_crtc_update_refresh(struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        u64 frame_ns = crtc->mode_frame_ns;
+
+        if (crtc->refresh && div_u64(NSEC_PER_SEC, crtc->refresh) > frame_ns)
+                frame_ns = div_u64(NSEC_PER_SEC, crtc->refresh);
+
+        XENGFX_SET_TIMESTAMPING_CLOCK(&crtc->drm_crtc,
+                                      div64_u64((u64)crtc->mode_clock *
+                                                crtc->mode_frame_ns,
+                                                frame_ns));
+        if (crtc->frame_ns != frame_ns) {
+                crtc->frame_ns = frame_ns;
+                xengfx_vblank_restart(crtc);
+        }
+
+        if (dev_priv->caps & XGFX_CAPS_TIMINGS)
+                xengfx_crtc_stage(crtc, &crtc->regs.refresh,
+                                  XGFX_VCRTC(crtc->crtc_id, REFRESH),
+                                  div64_u64(NSEC_PER_SEC * 1000ULL, frame_ns));
+}
+
+static int
+xengfx_crtc_mode_set(struct drm_crtc *drm_crtc, struct drm_display_mode *mode,
+		     struct drm_display_mode *adjusted_mode, int x, int y,
+		     struct drm_framebuffer *old_fb)
+{
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct drm_device *dev = drm_crtc->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        int ret;
+
+        drm_vblank_pre_modeset(dev, crtc_id);
+
+        crtc->mode_frame_ns = xengfx_mode_frame_ns(adjusted_mode);
+        crtc->mode_clock = adjusted_mode->clock;
+        crtc->vdisplay = adjusted_mode->crtc_vdisplay;
+        crtc->vtotal = adjusted_mode->crtc_vtotal;
+        XENGFX_SET_TIMESTAMPING_MODE(drm_crtc, adjusted_mode);
+
+        xengfx_crtc_stage(crtc, &crtc->regs.h_active,
+                          XGFX_VCRTC(crtc_id, H_ACTIVE),
+                          adjusted_mode->crtc_hdisplay - 1);
+        xengfx_crtc_stage(crtc, &crtc->regs.v_active,
+                          XGFX_VCRTC(crtc_id, V_ACTIVE),
+                          adjusted_mode->crtc_vdisplay - 1);
+        xengfx_crtc_set_timings(dev_priv, crtc, adjusted_mode);
+        xengfx_crtc_update_refresh(crtc);
+
+        /* Committed by xengfx_crtc_enable(), unless the CRTC is running */
+        ret = xengfx_crtc_set_base(drm_crtc, x, y, old_fb);
+        if (crtc->active)
+                xengfx_crtc_flush(crtc);
+        drm_vblank_post_modeset(dev, crtc_id);
+
+        return ret;
+}
+
+/*
+ * Tell the device that the frame scanned out by the CRTC is complete, so
+ * that it copies it once instead of polling the framebuffer.
+ */
+void xengfx_crtc_frame_done(struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+
+        if (!(dev_priv->caps & XGFX_CAPS_FRAME_SEQ))
+                return;
+
+        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc->crtc_id, FRAME_SEQ),
+                          atomic_inc_return(&crtc->frame_seq));
+}
+
+/*
+ * Queue a flip to drm_fb. The new base is written right away and latched by
+ * the device at the next retrace, where the flip completes. In mailbox mode
+ * a flip still pending is replaced and retired immediately, so that only the
+ * newest frame gets scanned out. The previous buffer is released at the
+ * retrace. Async flips replace a pending flip too, but have the device apply
+ * the new base at once: they complete, event and all, before returning. They
+ * need stage blocks, since only a COMMIT can bypass the retrace.
+ */
+int xengfx_crtc_queue_flip(struct drm_crtc *drm_crtc,
+                           struct drm_framebuffer *drm_fb,
+                           struct drm_pending_vblank_event *event,
+                           int mode)
+{
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct drm_device *dev = drm_crtc->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        struct xengfx_gem_object *obj = to_xengfx_fb(drm_fb)->obj;
+        struct xengfx_flip *flip;
+        struct xengfx_flip *replaced = NULL;
+        struct xengfx_flip *retired = NULL;
+        struct xengfx_flip *done = NULL;
+        unsigned long flags;
+        u32 format;
+        u32 base, uv_base, uv_stride;
+        u32 align;
+        int ret;
+
+        if (!crtc->active || !drm_crtc->fb || !obj)
+                return -EINVAL;
+
+        if (mode == XENGFX_FLIP_ASYNC && !dev_priv->stage)
+                return -EINVAL;
+
+        ret = xengfx_crtc_check_viewport(crtc, drm_fb, &drm_crtc->mode,
+                                         drm_crtc->x, drm_crtc->y);
+        if (ret)
+                return ret;
+
+        /* A flip can't change the layout of the scanout buffer */
+        ret = xengfx_fb_format(drm_fb, &format);
+        if (ret)
+                return ret;
+        if (format != crtc->regs.format || drm_fb->pitch != crtc->regs.stride)
+                return -EINVAL;
+        xengfx_fb_scanout(drm_fb, drm_crtc->x, drm_crtc->y, &base, &uv_base,
+                          &uv_stride);
+        if (format == XGFX_FORMAT_NV12 && uv_stride != crtc->regs.uv_stride)
+                return -EINVAL;
+
+        flip = kzalloc(sizeof (*flip), GFP_KERNEL);
+        if (!flip)
+                return -ENOMEM;
+        INIT_WORK(&flip->work, xengfx_flip_work_func);
+        flip->dev = dev;
+        flip->event = event;
+        flip->obj = obj;
+
+        ret = drm_vblank_get(dev, crtc_id);
+        if (ret)
+                goto free_flip;
+
+        mutex_lock(&dev->struct_mutex);
+        ret = xengfx_gem_object_pin(obj);
+        mutex_unlock(&dev->struct_mutex);
+        if (ret)
+                goto put_vblank;
+
+        base += obj->offset;
+        uv_base += obj->offset;
+
+        align = xengfx_crtc_regs(dev_priv, crtc)->stride_alignment;
+        if ((base & align) || (uv_base & align)) {
+                ret = -EINVAL;
+                goto unpin;
+        }
+
+        spin_lock_irqsave(&dev->event_lock, flags);
+        if (crtc->flip && xengfx_flip_latched(crtc, crtc->flip)) {
+                /* On screen already, its retrace just wasn't handled yet */
+                retired = crtc->flip;
+                crtc->flip = NULL;
+                if (retired->event)
+                        xengfx_send_vblank_event(dev, crtc_id, retired->event);
+        }
+        if (crtc->flip) {
+                if (mode == XENGFX_FLIP_QUEUED) {
+                        spin_unlock_irqrestore(&dev->event_lock, flags);
+                        ret = -EBUSY;
+                        goto unpin;
+                }
+
+                /*
+                 * The replaced frame never made it to the screen: the new
+                 * flip inherits the buffer which is still displayed, and the
+                 * replaced one releases its own buffer.
+                 */
+                replaced = crtc->flip;
+                flip->old_obj = replaced->old_obj;
+                replaced->old_obj = replaced->obj;
+                drm_gem_object_reference(&replaced->old_obj->gem_object);
+                if (replaced->event)
+                        xengfx_send_vblank_event(dev, crtc_id, replaced->event);
+        } else {
+                flip->old_obj = to_xengfx_fb(drm_crtc->fb)->obj;
+                drm_gem_object_reference(&flip->old_obj->gem_object);
+        }
+
+        crtc->base = base;
+        crtc->uv_base = uv_base;
+        /* With scaling, the new framebuffer may not have the same size */
+        xengfx_crtc_set_source(crtc, drm_fb, drm_crtc->x, drm_crtc->y);
+        if (format == XGFX_FORMAT_NV12)
+                xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, UV_BASE),
+                                        uv_base);
+        xengfx_crtc_stage_write(crtc, XGFX_VCRTC(crtc_id, BASE), base);
+
+        if (mode == XENGFX_FLIP_ASYNC) {
+                /* Scanned out once COMMIT returns, the old buffer is free */
+                xengfx_crtc_flush_now(crtc);
+                crtc->flip = NULL;
+                if (flip->event)
+                        xengfx_send_vblank_event(dev, crtc_id, flip->event);
+                done = flip;
+        } else {
+                crtc->flip = flip;
+                xengfx_crtc_flush(crtc);
+                /*
+                 * Sample the retrace count after the base is written: a
+                 * retrace counted meanwhile may delay the flip a frame, but
+                 * never completes it early.
+                 */
+                flip->retrace_seq = ACCESS_ONCE(crtc->retrace_count);
+                if (xengfx_crtc_retrace_pending(crtc))
+                        flip->retrace_seq++;
+        }
+        xengfx_crtc_frame_done(crtc);
+        spin_unlock_irqrestore(&dev->event_lock, flags);
+
+        if (retired)
+                xengfx_flip_release(crtc, retired);
+        if (done)
+                xengfx_flip_release(crtc, done);
+        if (replaced)
+                xengfx_flip_release(crtc, replaced);
+
+        drm_crtc->fb = drm_fb;
+
+        return 0;
+
+unpin:
+        mutex_lock(&dev->struct_mutex);
+        xengfx_gem_object_unpin(obj);
+        mutex_unlock(&dev->struct_mutex);
+put_vblank:
+        drm_vblank_put(dev, crtc_id);
+free_flip:
+        kfree(flip);
+        return ret;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33))
+static int xengfx_crtc_page_flip(struct drm_crtc *drm_crtc,
+                                 struct drm_framebuffer *drm_fb,
+                                 struct drm_pending_vblank_event *event)
+{
+        return xengfx_crtc_queue_flip(drm_crtc, drm_fb, event,
+                                      XENGFX_FLIP_QUEUED);
+}
+#endif
+
+static void xengfx_crtc_load_lut(struct drm_crtc *crtc)
+{
+}
+
+
+/*
+ * Cursor images stay pinned in a small per-CRTC cache, so that switching
+ * between a few shapes only costs a CURSOR_BASE write.
+ */
+static struct xengfx_cursor *
+xengfx_cursor_cache_lookup(struct xengfx_crtc *crtc,
+                           struct xengfx_gem_object *obj)
+{
+        int i;
+
+        for (i = 0; i < XENGFX_CURSOR_CACHE_SIZE; i++) {
+                if (crtc->cursor_cache[i].obj == obj)
+                        return &crtc->cursor_cache[i];
+        }
+
+        return NULL;
+}
+
+static void xengfx_cursor_cache_evict(struct xengfx_cursor *cursor)
+{
+        if (!cursor->obj)
+                return;
+
+        xengfx_gem_object_unpin(cursor->obj);
+        drm_gem_object_unreference(&cursor->obj->gem_object);
+        cursor->obj = NULL;
+}
+
+/* Called with struct_mutex held, takes over the reference on obj */
+static struct xengfx_cursor *
+xengfx_cursor_cache_insert(struct xengfx_crtc *crtc,
+                           struct xengfx_gem_object *obj)
+{
+        struct xengfx_cursor *cursor = &crtc->cursor_cache[0];
+        int ret;
+        int i;
+
+        /* Pick a free slot, or the least recently used one */
+        for (i = 0; i < XENGFX_CURSOR_CACHE_SIZE; i++) {
+                if (!crtc->cursor_cache[i].obj) {
+                        cursor = &crtc->cursor_cache[i];
+                        break;
+                }
+                if (crtc->cursor_cache[i].last_used < cursor->last_used)
+                        cursor = &crtc->cursor_cache[i];
+        }
+
+        ret = xengfx_gem_object_pin(obj);
+        if (ret)
+                return ERR_PTR(ret);
+
+        xengfx_cursor_cache_evict(cursor);
+        cursor->obj = obj;
+
+        return cursor;
+}
+
+static void xengfx_cursor_cache_cleanup(struct xengfx_crtc *crtc)
+{
+        struct drm_device *dev = crtc->drm_crtc.dev;
+        int i;
+
+        mutex_lock(&dev->struct_mutex);
+        for (i = 0; i < XENGFX_CURSOR_CACHE_SIZE; i++)
+                xengfx_cursor_cache_evict(&crtc->cursor_cache[i]);
+        mutex_unlock(&dev->struct_mutex);
+}
+
+static void xengfx_cursor_show(struct xengfx_crtc *crtc, bool show)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+
+        if (crtc->cursor_visible == show)
+                return;
+
+        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc->crtc_id, CURSOR_CONTROL),
+                          show ? XGFX_VCRTC_CURSOR_CONTROL_SHOW : 0);
+        crtc->cursor_visible = show;
+}
+
+static int
+xengfx_crtc_cursor_set(struct drm_crtc *drm_crtc, struct drm_file *file,
+                       uint32_t handle, uint32_t width, uint32_t height)
+{
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct drm_device *dev = drm_crtc->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        struct drm_gem_object *gem_obj;
+        struct xengfx_gem_object *obj;
+        struct xengfx_cursor *cursor;
+        u32 size;
+
+        if (!crtc->cursor_supported)
+                return -ENXIO;
+
+        if (!handle) {
+                xengfx_cursor_show(crtc, false);
+                return 0;
+        }
+
+        if (width > crtc->cursor_max_width || height > crtc->cursor_max_height)
+                return -EINVAL;
+
+        gem_obj = drm_gem_object_lookup(dev, file, handle);
+        if (!gem_obj)
+                return -ENOENT;
+        obj = to_xengfx_bo(gem_obj);
+
+        /* Cursor images are 32 bits ARGB, without padding */
+        if (gem_obj->size < width * height * 4) {
+                DRM_GEM_OBJECT_UNREFERENCE(gem_obj);
+                return -EINVAL;
+        }
+
+        mutex_lock(&dev->struct_mutex);
+        cursor = xengfx_cursor_cache_lookup(crtc, obj);
+        if (cursor) {
+                drm_gem_object_unreference(gem_obj);
+        } else {
+                cursor = xengfx_cursor_cache_insert(crtc, obj);
+                if (IS_ERR(cursor)) {
+                        drm_gem_object_unreference(gem_obj);
+                        mutex_unlock(&dev->struct_mutex);
+                        return PTR_ERR(cursor);
+                }
+        }
+        cursor->last_used = ++crtc->cursor_serial;
+        mutex_unlock(&dev->struct_mutex);
+
+        size = (width << XGFX_VCRTC_CURSOR_X_SHIFT) & XGFX_VCRTC_CURSOR_X_MASK;
+        size |= (height << XGFX_VCRTC_CURSOR_Y_SHIFT) & XGFX_VCRTC_CURSOR_Y_MASK;
+        if (crtc->cursor_size != size) {
+                xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, CURSOR_SIZE),
+                                  size);
+                crtc->cursor_size = size;
+        }
+
+        if (crtc->cursor_base != obj->offset) {
+                xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, CURSOR_BASE),
+                                  obj->offset);
+                crtc->cursor_base = obj->offset;
+        }
+
+        xengfx_cursor_show(crtc, true);
+
+        return 0;
+}
+
+
+static int
+xengfx_crtc_cursor_move(struct drm_crtc *drm_crtc, int x, int y)
+{
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct xengfx_private *dev_priv = drm_crtc->dev->dev_private;
+        u32 pos;
+
+        if (!crtc->cursor_supported)
+                return -ENXIO;
+
+        /* Coordinates are signed, the cursor can go past the top-left corner */
+        pos = ((u16)x << XGFX_VCRTC_CURSOR_X_SHIFT) & XGFX_VCRTC_CURSOR_X_MASK;
+        pos |= ((u16)y << XGFX_VCRTC_CURSOR_Y_SHIFT) & XGFX_VCRTC_CURSOR_Y_MASK;
+        if (crtc->cursor_pos == pos)
+                return 0;
+
+        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc->crtc_id, CURSOR_POS), pos);
+        crtc->cursor_pos = pos;
+
+        return 0;
+}
+
+static void xengfx_cursor_init(struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        int crtc_id = crtc->crtc_id;
+        u32 v;
+
+        v = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id, CURSOR_STATUS));
+        if (v == 0xffffffff || !(v & XGFX_VCRTC_CURSOR_STATUS_SUPPORTED))
+                return;
+
+        v = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id, CURSOR_MAXSIZE));
+        crtc->cursor_max_width = (v & XGFX_VCRTC_CURSOR_X_MASK) >>
+                                 XGFX_VCRTC_CURSOR_X_SHIFT;
+        crtc->cursor_max_height = (v & XGFX_VCRTC_CURSOR_Y_MASK) >>
+                                  XGFX_VCRTC_CURSOR_Y_SHIFT;
+
+        /* Start hidden, the other registers are written on first use */
+        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, CURSOR_CONTROL), 0);
+        crtc->cursor_supported = true;
+}
+
+
+static void
+XENGFX_CRTC_GAMMA_SET_SIGNATURE
+{
+        /* I doubt we are going to implement this */
+}
+
+static void xengfx_crtc_destroy(struct drm_crtc *drm_crtc)
+{
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct drm_device *dev = drm_crtc->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        xengfx_vblank_timer_fini(crtc);
+        cancel_delayed_work_sync(&crtc->hotplug_work);
+        xengfx_cursor_cache_cleanup(crtc);
+        drm_crtc_cleanup(drm_crtc);
         dev_priv->crtcs[crtc->crtc_id] = NULL;
 
-        /*
-         * drm_mode_config_cleanup() should already have called
-         * encoder_destroy() and connector_destroy() at this point,
-         * so there's nothing else to do here.
-         */
+        /*
+         * drm_mode_config_cleanup() should already have called
+         * encoder_destroy() and connector_destroy() at this point,
+         * so there's nothing else to do here.
+         */
+
+        kfree(crtc);
+}
+
+/*
+ * A configuration which keeps the mode and the connector of an active CRTC
+ * only needs a new scanout buffer: there is no reason to go through
+ * prepare/commit and blank the screen for that.
+ */
+static bool xengfx_crtc_can_fastset(struct drm_mode_set *set)
+{
+        struct drm_crtc *drm_crtc = set->crtc;
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+
+        if (!crtc->active || !drm_crtc->enabled || !drm_crtc->fb)
+                return false;
+
+        if (!set->fb || !set->mode)
+                return false;
+
+        if (set->num_connectors != 1 ||
+            set->connectors[0] != &crtc->connector ||
+            !crtc->connector.encoder)
+                return false;
+
+        return drm_mode_equal(set->mode, &drm_crtc->mode);
+}
+
+static int xengfx_crtc_fastset(struct drm_mode_set *set)
+{
+        struct drm_crtc *drm_crtc = set->crtc;
+        struct xengfx_crtc *crtc = to_xengfx_crtc(drm_crtc);
+        struct drm_framebuffer *old_fb = drm_crtc->fb;
+        int old_x = drm_crtc->x;
+        int old_y = drm_crtc->y;
+        int ret;
+
+        ret = xengfx_crtc_check(crtc, set->fb, set->mode, set->x, set->y);
+        if (ret)
+                return ret;
+
+        drm_crtc->fb = set->fb;
+        drm_crtc->x = set->x;
+        drm_crtc->y = set->y;
+
+        ret = xengfx_crtc_set_base(drm_crtc, set->x, set->y, old_fb);
+        if (ret) {
+                drm_crtc->fb = old_fb;
+                drm_crtc->x = old_x;
+                drm_crtc->y = old_y;
+        }
+
+        return ret;
+}
+
+static int xengfx_crtc_helper_set_config(struct drm_mode_set *set)
+{
+        CRTC_HELPER_SET_CONFIG_EXTRA_WORK;
+
+        if (xengfx_crtc_can_fastset(set))
+                return xengfx_crtc_fastset(set);
+
+        return drm_crtc_helper_set_config(set);
+}
+
+static const struct drm_crtc_helper_funcs xengfx_crtc_helper_funcs = {
+        .dpms = xengfx_crtc_dpms,
+        .mode_fixup = xengfx_crtc_mode_fixup,
+        .mode_set = xengfx_crtc_mode_set,
+        .mode_set_base = xengfx_crtc_set_base,
+        .load_lut = xengfx_crtc_load_lut,
+        .prepare = xengfx_crtc_prepare,
+        .commit = xengfx_crtc_commit,
+};
+
+static const struct drm_crtc_funcs xengfx_crtc_funcs = {
+        .cursor_set = xengfx_crtc_cursor_set,
+        .cursor_move = xengfx_crtc_cursor_move,
+        .gamma_set = xengfx_crtc_gamma_set,
+        .set_config = xengfx_crtc_helper_set_config,
+        PAGE_FLIP_IMPLEMENTATION
+        .destroy = xengfx_crtc_destroy,
+};
+
+/* Connector properties, which act on the CRTC of the connector */
+static int xengfx_connector_set_property(struct drm_connector *connector,
+                                         struct drm_property *property,
+                                         uint64_t value)
+{
+        struct xengfx_crtc *crtc = conn_to_xengfx_crtc(connector);
+        struct drm_device *dev = connector->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        int ret;
+
+        if (property == dev_priv->refresh_property) {
+                ret = drm_connector_property_set_value(connector, property,
+                                                       value);
+                if (ret)
+                        return ret;
+
+                crtc->refresh = value;
+                if (crtc->active) {
+                        xengfx_crtc_update_refresh(crtc);
+                        xengfx_crtc_flush(crtc);
+                }
+
+                return 0;
+        }
+
+        if (property == dev->mode_config.scaling_mode_property) {
+                struct drm_crtc *drm_crtc = &crtc->drm_crtc;
+                unsigned int old_scaling = crtc->scaling;
+
+                crtc->scaling = value;
+                if (crtc->active && drm_crtc->fb) {
+                        ret = xengfx_crtc_check(crtc, drm_crtc->fb,
+                                                &drm_crtc->mode,
+                                                drm_crtc->x, drm_crtc->y);
+                        if (ret) {
+                                crtc->scaling = old_scaling;
+                                return ret;
+                        }
+                        xengfx_crtc_set_source(crtc, drm_crtc->fb,
+                                               drm_crtc->x, drm_crtc->y);
+                        xengfx_crtc_flush(crtc);
+                }
+
+                return drm_connector_property_set_value(connector, property,
+                                                        value);
+        }
+
+        return -EINVAL;
+}
+
+static const struct drm_connector_funcs xengfx_connector_funcs = {
+        .detect = xengfx_connector_detect,
+        .fill_modes = drm_helper_probe_single_connector_modes,
+        .set_property = xengfx_connector_set_property,
+        .destroy = xengfx_connector_destroy,
+};
+
+/* Time to let a storm of hotplug events settle, e.g. on host window resize */
+#define XENGFX_HOTPLUG_DELAY        msecs_to_jiffies(100)
+
+/*
+ * Reprobe the connector of the CRTC which changed. The host may also have
+ * resized the display without disconnecting it, xengfx_get_edid() will find
+ * out on the next probe.
+ */
+static void xengfx_crtc_hotplug_work_func(struct work_struct *work)
+{
+        struct xengfx_crtc *crtc = container_of(work, struct xengfx_crtc,
+                                                hotplug_work.work);
+        struct drm_connector *connector = &crtc->connector;
+        struct drm_device *dev = connector->dev;
+        enum drm_connector_status old_status;
+
+        mutex_lock(&dev->mode_config.mutex);
+        old_status = connector->status;
+        connector->status = XENGFX_CONNECTOR_DETECT_CALL(connector);
+        mutex_unlock(&dev->mode_config.mutex);
 
-        kfree(crtc);
+        DRM_DEBUG_KMS("CRTC %d: connector status %d -> %d\n", crtc->crtc_id,
+                      old_status, connector->status);
+
+        XENGFX_HOTPLUG_EVENT(dev);
 }
 
-static int xengfx_crtc_helper_set_config(struct drm_mode_set *set)
+/*
+ * Publish the onscreen state of the CRTCs through their connector property,
+ * and suspend fbdev while none is displayed. This runs from a work item to
+ * take mode_config.mutex. The console lock can only be taken once it is
+ * dropped, onscreen_mutex keeps the updates in order.
+ */
+static void xengfx_onscreen_work_func(struct work_struct *work)
 {
-        CRTC_HELPER_SET_CONFIG_EXTRA_WORK;
-        return drm_crtc_helper_set_config(set);
+        struct xengfx_private *dev_priv =
+                container_of(work, struct xengfx_private, onscreen_work);
+        struct drm_device *dev = dev_priv->dev;
+        struct drm_property *property = dev_priv->onscreen_property;
+        bool any_onscreen = false;
+        int i;
+
+        mutex_lock(&dev_priv->onscreen_mutex);
+
+        mutex_lock(&dev->mode_config.mutex);
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                struct xengfx_crtc *crtc = dev_priv->crtcs[i];
+
+                if (!crtc)
+                        continue;
+                if (crtc->onscreen)
+                        any_onscreen = true;
+                if (property)
+                        drm_connector_property_set_value(&crtc->connector,
+                                                         property,
+                                                         crtc->onscreen);
+        }
+        mutex_unlock(&dev->mode_config.mutex);
+
+        if (any_onscreen != dev_priv->fbdev_onscreen) {
+                dev_priv->fbdev_onscreen = any_onscreen;
+                xengfx_fbdev_set_onscreen(dev, any_onscreen);
+        }
+
+        mutex_unlock(&dev_priv->onscreen_mutex);
 }
 
-static const struct drm_crtc_helper_funcs xengfx_crtc_helper_funcs = {
-        .dpms = xengfx_crtc_dpms,
-        .mode_fixup = xengfx_crtc_mode_fixup,
-        .mode_set = xengfx_crtc_mode_set,
-        .mode_set_base = xengfx_crtc_set_base,
-        .load_lut = xengfx_crtc_load_lut,
-        .prepare = xengfx_crtc_prepare,
-        .commit = xengfx_crtc_commit,
-};
+/*
+ * Bring fbdev in line with the onscreen state, which it doesn't follow
+ * until a CRTC changes otherwise.
+ */
+void xengfx_onscreen_init(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
 
-static const struct drm_crtc_funcs xengfx_crtc_funcs = {
-        .cursor_set = xengfx_crtc_cursor_set,
-        .cursor_move = xengfx_crtc_cursor_move,
-        .gamma_set = xengfx_crtc_gamma_set,
-        .set_config = xengfx_crtc_helper_set_config,
-        .destroy = xengfx_crtc_destroy,
-};
+        schedule_work(&dev_priv->onscreen_work);
+}
+
+void xengfx_onscreen_fini(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        cancel_work_sync(&dev_priv->onscreen_work);
+}
 
 /*
- * These are called from irq context
+ * These are called from the interrupt thread
  */
-void xengfx_crtc_status_onscreen(struct xengfx_crtc *crtc, int enable)
+void xengfx_crtc_status_onscreen(struct xengfx_crtc *crtc)
 {
-        /* XXX */
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        unsigned long flags;
+        bool onscreen;
+
+        /*
+         * The retrace thread of an MSI-X vector may handle the events of the
+         * CRTC too: use the latest status, this change may be handled already.
+         */
+        spin_lock_irqsave(&dev_priv->onscreen_lock, flags);
+        onscreen = ACCESS_ONCE(crtc->irq_status) & XGFX_VCRTC_STATUS_ONSCREEN;
+        if (crtc->onscreen == onscreen) {
+                spin_unlock_irqrestore(&dev_priv->onscreen_lock, flags);
+                return;
+        }
+        crtc->onscreen = onscreen;
+        xengfx_vblank_restart(crtc);
+        spin_unlock_irqrestore(&dev_priv->onscreen_lock, flags);
+
+        schedule_work(&dev_priv->onscreen_work);
 }
 
 void xengfx_crtc_status_connected(struct xengfx_crtc *crtc, int enable)
 {
-        /* XXX */
+        /* Every new event pushes the reprobe back */
+        cancel_delayed_work(&crtc->hotplug_work);
+        schedule_delayed_work(&crtc->hotplug_work, XENGFX_HOTPLUG_DELAY);
+}
+
+void xengfx_crtc_status_edid(struct xengfx_crtc *crtc)
+{
+        crtc->edid_pending = false;
+        wake_up(&crtc->edid_wait);
 }
 
 static void xengfx_crtc_init(struct drm_device *dev, int crtc_id)
 {
         struct xengfx_private *dev_priv = dev->dev_private;
         struct xengfx_crtc *crtc;
-        struct edid *edid;
 
         crtc = kzalloc(sizeof (*crtc), GFP_KERNEL);
         if (!crtc)
                 return;
         crtc->crtc_id = crtc_id;
+        xengfx_crtc_regs_reset(crtc);
+        crtc->onscreen = !!(xengfx_mmio_read(dev_priv,
+                                             XGFX_VCRTC(crtc_id, STATUS)) &
+                            XGFX_VCRTC_STATUS_ONSCREEN);
+        xengfx_vblank_timer_init(crtc);
+        INIT_DELAYED_WORK(&crtc->hotplug_work, xengfx_crtc_hotplug_work_func);
+        init_waitqueue_head(&crtc->edid_wait);
 
         drm_connector_init(dev, &crtc->connector, &xengfx_connector_funcs,
                            DRM_MODE_CONNECTOR_LVDS);
         drm_connector_helper_add(&crtc->connector, &xengfx_connector_helper_funcs);
         crtc->connector.interlace_allowed = 0;
         crtc->connector.doublescan_allowed = 0;
+        XENGFX_CONNECTOR_SET_POLLED(&crtc->connector);
+        if (dev_priv->onscreen_property)
+                drm_connector_attach_property(&crtc->connector,
+                                              dev_priv->onscreen_property,
+                                              crtc->onscreen);
+        if (dev_priv->refresh_property)
+                drm_connector_attach_property(&crtc->connector,
+                                              dev_priv->refresh_property, 0);
+        if (dev_priv->caps & XGFX_CAPS_SCALING)
+                drm_connector_attach_property(&crtc->connector,
+                                              dev->mode_config.scaling_mode_property,
+                                              XGFX_SCALING_NONE);
         crtc->connector.status = XENGFX_CONNECTOR_DETECT_CALL(&crtc->connector);
 
         drm_mode_connector_attach_encoder(&crtc->connector, &dev_priv->encoder);
@@ -504,15 +1815,12 @@ static void xengfx_crtc_init(struct drm_device *dev, int crtc_id)
         drm_crtc_helper_add(&crtc->drm_crtc, &xengfx_crtc_helper_funcs);
         dev_priv->crtcs[crtc_id] = crtc;
 
+        xengfx_cursor_init(crtc);
+
         drm_sysfs_connector_add(&crtc->connector);
 
-        if (crtc->connector.status == connector_status_connected) {
-                edid = xengfx_get_edid(&crtc->connector, NULL);
-                if (edid && drm_add_edid_modes(&crtc->connector, edid)) {
-                       drm_mode_connector_update_edid_property(&crtc->connector,
-		       					       edid);
-                }
-        }
+        if (crtc->connector.status == connector_status_connected)
+                xengfx_connector_get_modes(&crtc->connector);
 }
 
 /* Framebuffer part */
@@ -538,9 +1846,124 @@ static int xengfx_fb_create_handle(struct drm_framebuffer *drm_fb,
         return drm_gem_handle_create(file, &obj->gem_object, handle);
 }
 
+/* Past this, send the whole frame rather than the rectangles */
+#define XENGFX_DAMAGE_MAX_RECTS     16
+
+/* Add a rectangle to the list, merging it with one it overlaps or touches */
+static int xengfx_damage_merge(struct drm_clip_rect *rects, int count,
+                               struct drm_clip_rect *r)
+{
+        int i;
+
+        for (i = 0; i < count; i++) {
+                struct drm_clip_rect *m = &rects[i];
+
+                if (r->x1 > m->x2 || r->x2 < m->x1 ||
+                    r->y1 > m->y2 || r->y2 < m->y1)
+                        continue;
+
+                m->x1 = min(m->x1, r->x1);
+                m->y1 = min(m->y1, r->y1);
+                m->x2 = max(m->x2, r->x2);
+                m->y2 = max(m->y2, r->y2);
+                return count;
+        }
+
+        rects[count] = *r;
+        return count + 1;
+}
+
+/*
+ * Forward damage to drm_fb to the device, for each CRTC scanning it out,
+ * relative to the area it scans out, and mark the frame complete. Every inc-th
+ * clip rectangle is used, no rectangle at all means the whole framebuffer.
+ */
+void xengfx_fb_damage(struct drm_framebuffer *drm_fb,
+                      struct drm_clip_rect *clips, unsigned num_clips,
+                      unsigned inc)
+{
+        struct drm_device *dev = drm_fb->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct drm_clip_rect rects[XENGFX_DAMAGE_MAX_RECTS];
+        int crtc_id;
+
+        for (crtc_id = 0; crtc_id < dev_priv->crtc_count; crtc_id++) {
+                struct xengfx_crtc *crtc = dev_priv->crtcs[crtc_id];
+                struct drm_crtc *drm_crtc;
+                struct drm_clip_rect full;
+                u32 width, height;
+                int count = 0;
+                unsigned i;
+
+                if (!crtc || !crtc->active || crtc->drm_crtc.fb != drm_fb)
+                        continue;
+                drm_crtc = &crtc->drm_crtc;
+
+                if (!dev_priv->damage_ring)
+                        goto done;
+
+                /* Before scaling, the area is SOURCE_SIZE and not the mode */
+                xengfx_crtc_source_size(crtc, drm_fb, drm_crtc->x, drm_crtc->y,
+                                        &width, &height);
+                full.x1 = 0;
+                full.y1 = 0;
+                full.x2 = width;
+                full.y2 = height;
+
+                for (i = 0; i < num_clips && count >= 0; i += inc) {
+                        struct drm_clip_rect r;
+                        int x1 = clips[i].x1 - drm_crtc->x;
+                        int y1 = clips[i].y1 - drm_crtc->y;
+                        int x2 = clips[i].x2 - drm_crtc->x;
+                        int y2 = clips[i].y2 - drm_crtc->y;
+
+                        r.x1 = clamp(x1, 0, (int)full.x2);
+                        r.y1 = clamp(y1, 0, (int)full.y2);
+                        r.x2 = clamp(x2, 0, (int)full.x2);
+                        r.y2 = clamp(y2, 0, (int)full.y2);
+                        if (r.x1 >= r.x2 || r.y1 >= r.y2)
+                                continue;
+
+                        if (count == XENGFX_DAMAGE_MAX_RECTS)
+                                count = -1;
+                        else
+                                count = xengfx_damage_merge(rects, count, &r);
+                }
+
+                if (!num_clips || count < 0)
+                        xengfx_damage_push(dev_priv, crtc_id, &full, 1);
+                else if (count)
+                        xengfx_damage_push(dev_priv, crtc_id, rects, count);
+done:
+                xengfx_crtc_frame_done(crtc);
+        }
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33))
+static int XENGFX_FB_DIRTY_SIGNATURE
+{
+        struct drm_device *dev = drm_fb->dev;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        unsigned inc = 1;
+
+        /* Let userspace know it can stop calling us */
+        if (!dev_priv->damage_ring && !(dev_priv->caps & XGFX_CAPS_FRAME_SEQ))
+                return -ENOSYS;
+
+        /* Copies come as pairs of destination and source rectangles */
+        if (flags & DRM_MODE_FB_DIRTY_ANNOTATE_COPY)
+                inc = 2;
+
+        xengfx_fb_damage(drm_fb, clips, num_clips, inc);
+
+        return 0;
+}
+#endif
+
 static const struct drm_framebuffer_funcs xengfx_fb_funcs = {
         .destroy = xengfx_fb_destroy,
-        .create_handle = xengfx_fb_create_handle
+        .create_handle = xengfx_fb_create_handle,
+        DIRTY_IMPLEMENTATION
 };
 
 /**
@@ -565,6 +1988,34 @@ int xengfx_framebuffer_init(struct drm_device *dev,
         return 0;
 }
 
+/*
+ * Reject at creation a framebuffer that no CRTC could scan out, rather than
+ * at modeset. The buffer object has to hold the whole framebuffer.
+ */
+static int xengfx_fb_check(struct drm_device *dev,
+                           struct drm_mode_fb_cmd *mode_cmd,
+                           struct xengfx_gem_object *obj)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        u32 cpp = (mode_cmd->bpp + 7) / 8;
+        int i;
+
+        if (!mode_cmd->width || !mode_cmd->height ||
+            mode_cmd->pitch < mode_cmd->width * cpp ||
+            (u64)mode_cmd->pitch * mode_cmd->height > obj->gem_object.size)
+                return -EINVAL;
+
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                struct xengfx_crtc *crtc = dev_priv->crtcs[i];
+
+                if (crtc && xengfx_bpp_valid(crtc, mode_cmd->bpp) &&
+                    xengfx_stride_valid(crtc, mode_cmd->pitch))
+                        return 0;
+        }
+
+        return -EINVAL;
+}
+
 /**
  * This is the userspace framebuffer creation function.
  * For fbdev, check xengfx_fb.c::xengfx_fb_probe()
@@ -582,6 +2033,12 @@ static struct drm_framebuffer *xengfx_fb_create(struct drm_device *dev,
         if (&obj->gem_object == NULL)
                 return ERR_PTR(-ENOENT);
 
+        ret = xengfx_fb_check(dev, mode_cmd, obj);
+        if (ret) {
+                DRM_GEM_OBJECT_UNREFERENCE(&obj->gem_object);
+                return ERR_PTR(ret);
+        }
+
         xengfx_fb = kzalloc(sizeof (*xengfx_fb), GFP_KERNEL);
         if (!xengfx_fb) {
                 DRM_GEM_OBJECT_UNREFERENCE(&obj->gem_object);
@@ -598,11 +2055,484 @@ static struct drm_framebuffer *xengfx_fb_create(struct drm_device *dev,
         return &xengfx_fb->drm_fb;
 }
 
+/*
+ * Give a framebuffer a YUV layout. ADDFB has no way to describe several
+ * planes, so the framebuffer is created first, e.g. with 16bpp for YUYV or
+ * 8bpp for NV12, and its layout set here before it is scanned out.
+ */
+int xengfx_fb_format_ioctl(struct drm_device *dev, void *data,
+                           struct drm_file *file_priv)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct drm_xengfx_fb_format *args = data;
+        struct xengfx_framebuffer *fb = NULL;
+        struct drm_framebuffer *drm_fb;
+        u32 format, size, width, height;
+        u32 valid = 0;
+        int i;
+        int ret = 0;
+
+        switch (args->format) {
+        case XENGFX_FB_FORMAT_RGB:
+                format = 0;
+                break;
+        case XENGFX_FB_FORMAT_YUYV:
+                format = XGFX_FORMAT_YUYV;
+                break;
+        case XENGFX_FB_FORMAT_NV12:
+                format = XGFX_FORMAT_NV12;
+                break;
+        case XENGFX_FB_FORMAT_RGB_ORDER:
+                format = XGFX_FORMAT_RGB555 | XGFX_FORMAT_RGB565 |
+                         XGFX_FORMAT_RGB888 | XGFX_FORMAT_RGB8888;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        mutex_lock(&dev->mode_config.mutex);
+
+        /* Only the framebuffers of the caller */
+        list_for_each_entry(drm_fb, &file_priv->fbs, filp_head) {
+                if (drm_fb->base.id == args->fb_id) {
+                        fb = to_xengfx_fb(drm_fb);
+                        break;
+                }
+        }
+        if (!fb) {
+                ret = -ENOENT;
+                goto out;
+        }
+
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                struct xengfx_crtc *crtc = dev_priv->crtcs[i];
+
+                if (!crtc)
+                        continue;
+                if (crtc->drm_crtc.fb == &fb->drm_fb) {
+                        ret = -EBUSY;
+                        goto out;
+                }
+                valid |= xengfx_crtc_regs(dev_priv, crtc)->valid_format;
+        }
+
+        width = fb->drm_fb.width;
+        height = fb->drm_fb.height;
+        size = fb->obj->gem_object.size;
+
+        /* Pick the RGB order format at the depth of the framebuffer */
+        if (args->format == XENGFX_FB_FORMAT_RGB_ORDER) {
+                format &= xengfx_bpp_formats(fb->drm_fb.bits_per_pixel);
+                if (!format) {
+                        ret = -EINVAL;
+                        goto out;
+                }
+        }
+
+        switch (format) {
+        case XGFX_FORMAT_YUYV:
+                if ((width & 1) || args->pitches[0] < width * 2 ||
+                    (u64)args->offsets[0] + (u64)args->pitches[0] * height > size)
+                        ret = -EINVAL;
+                break;
+        case XGFX_FORMAT_NV12:
+                if ((width & 1) || (height & 1) ||
+                    args->pitches[0] < width || args->pitches[1] < width ||
+                    (u64)args->offsets[0] + (u64)args->pitches[0] * height > size ||
+                    (u64)args->offsets[1] + (u64)args->pitches[1] * height / 2 > size)
+                        ret = -EINVAL;
+                break;
+        }
+        if (ret)
+                goto out;
+
+        if (format && !(valid & format)) {
+                ret = -EINVAL;
+                goto out;
+        }
+
+        fb->format = format;
+        if (format & (XGFX_FORMAT_YUYV | XGFX_FORMAT_NV12)) {
+                fb->offsets[0] = args->offsets[0];
+                fb->offsets[1] = args->offsets[1];
+                fb->pitches[0] = args->pitches[0];
+                fb->pitches[1] = args->pitches[1];
+        } else {
+                fb->offsets[0] = 0;
+                fb->offsets[1] = 0;
+                fb->pitches[0] = fb->drm_fb.pitch;
+                fb->pitches[1] = 0;
+        }
+        fb->drm_fb.pitch = fb->pitches[0];
+out:
+        mutex_unlock(&dev->mode_config.mutex);
+
+        return ret;
+}
+
+/* Tell userspace what a CRTC can scan out, so it can render in that layout */
+int xengfx_crtc_info_ioctl(struct drm_device *dev, void *data,
+                           struct drm_file *file_priv)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct drm_xengfx_crtc_info *args = data;
+        struct drm_mode_object *obj;
+        struct xengfx_crtc *crtc;
+        int ret = 0;
+
+        mutex_lock(&dev->mode_config.mutex);
+
+        obj = drm_mode_object_find(dev, args->crtc_id, DRM_MODE_OBJECT_CRTC);
+        if (!obj) {
+                ret = -EINVAL;
+                goto out;
+        }
+        crtc = to_xengfx_crtc(obj_to_crtc(obj));
+
+        /* XENGFX_FORMAT_* are the device format bits */
+        args->formats = xengfx_crtc_regs(dev_priv, crtc)->valid_format;
+        args->stride_alignment = crtc->regs.stride_alignment + 1;
+out:
+        mutex_unlock(&dev->mode_config.mutex);
+
+        return ret;
+}
+
 static struct drm_mode_config_funcs xengfx_mode_funcs = {
         .fb_create = xengfx_fb_create,
         XENGFX_MODE_FUNCS_COMPAT,
 };
 
+/* Atomic part */
+
+static void xengfx_mode_from_umode(struct drm_display_mode *mode,
+                                   struct drm_mode_modeinfo *umode)
+{
+        memset(mode, 0, sizeof (*mode));
+
+        mode->clock = umode->clock;
+        mode->hdisplay = umode->hdisplay;
+        mode->hsync_start = umode->hsync_start;
+        mode->hsync_end = umode->hsync_end;
+        mode->htotal = umode->htotal;
+        mode->hskew = umode->hskew;
+        mode->vdisplay = umode->vdisplay;
+        mode->vsync_start = umode->vsync_start;
+        mode->vsync_end = umode->vsync_end;
+        mode->vtotal = umode->vtotal;
+        mode->vscan = umode->vscan;
+        mode->vrefresh = umode->vrefresh;
+        mode->flags = umode->flags;
+        mode->type = umode->type;
+        strncpy(mode->name, umode->name, DRM_DISPLAY_MODE_LEN);
+        mode->name[DRM_DISPLAY_MODE_LEN - 1] = '\0';
+}
+
+static void xengfx_crtc_wait_vblank(struct drm_device *dev, int crtc_id)
+{
+        u32 count;
+
+        if (drm_vblank_get(dev, crtc_id))
+                return;
+
+        count = drm_vblank_count(dev, crtc_id);
+        wait_event_timeout(dev->vbl_queue[crtc_id],
+                           count != drm_vblank_count(dev, crtc_id),
+                           msecs_to_jiffies(100));
+
+        drm_vblank_put(dev, crtc_id);
+}
+
+static int xengfx_atomic_check_flip(struct xengfx_crtc *crtc,
+                                    struct drm_xengfx_crtc_state *state,
+                                    struct drm_framebuffer **drm_fb)
+{
+        struct drm_crtc *drm_crtc = &crtc->drm_crtc;
+        struct xengfx_private *dev_priv = drm_crtc->dev->dev_private;
+        struct drm_mode_object *obj;
+        u32 format;
+
+        if (!crtc->active || !drm_crtc->fb)
+                return -EINVAL;
+
+        if (crtc->flip && !(state->flags & (XENGFX_CRTC_STATE_MAILBOX |
+                                            XENGFX_CRTC_STATE_ASYNC)))
+                return -EBUSY;
+
+        if ((state->flags & XENGFX_CRTC_STATE_ASYNC) && !dev_priv->stage)
+                return -EINVAL;
+
+        obj = drm_mode_object_find(drm_crtc->dev, state->fb_id,
+                                   DRM_MODE_OBJECT_FB);
+        if (!obj)
+                return -EINVAL;
+        *drm_fb = obj_to_fb(obj);
+
+        if (xengfx_crtc_check_viewport(crtc, *drm_fb, &drm_crtc->mode,
+                                       drm_crtc->x, drm_crtc->y))
+                return -ENOSPC;
+
+        if (xengfx_fb_format(*drm_fb, &format) ||
+            format != crtc->regs.format ||
+            (*drm_fb)->pitch != crtc->regs.stride)
+                return -EINVAL;
+
+        return 0;
+}
+
+static int xengfx_atomic_commit_flip(struct xengfx_crtc *crtc,
+                                     struct drm_xengfx_crtc_state *state,
+                                     struct drm_framebuffer *drm_fb,
+                                     struct drm_file *file_priv)
+{
+        struct drm_device *dev = crtc->drm_crtc.dev;
+        struct drm_pending_vblank_event *event = NULL;
+        int mode = XENGFX_FLIP_QUEUED;
+        int ret;
+
+        if (state->flags & XENGFX_CRTC_STATE_ASYNC)
+                mode = XENGFX_FLIP_ASYNC;
+        else if (state->flags & XENGFX_CRTC_STATE_MAILBOX)
+                mode = XENGFX_FLIP_MAILBOX;
+
+        if (state->flags & XENGFX_CRTC_STATE_EVENT) {
+                event = xengfx_create_vblank_event(dev, file_priv,
+                                                   state->user_data);
+                if (!event)
+                        return -ENOMEM;
+        }
+
+        ret = xengfx_crtc_queue_flip(&crtc->drm_crtc, drm_fb, event, mode);
+        if (ret && event)
+                xengfx_destroy_vblank_event(dev, event);
+
+        return ret;
+}
+
+/* Configuration of a CRTC before an atomic commit, to undo it */
+struct xengfx_atomic_saved {
+        struct drm_framebuffer *fb;
+        struct drm_display_mode mode;
+        int x;
+        int y;
+};
+
+static void xengfx_atomic_save(struct xengfx_crtc *crtc,
+                               struct xengfx_atomic_saved *saved)
+{
+        struct drm_crtc *drm_crtc = &crtc->drm_crtc;
+
+        saved->fb = drm_crtc->enabled ? drm_crtc->fb : NULL;
+        saved->mode = drm_crtc->mode;
+        saved->x = drm_crtc->x;
+        saved->y = drm_crtc->y;
+}
+
+static void xengfx_atomic_restore(struct xengfx_crtc *crtc,
+                                  struct xengfx_atomic_saved *saved)
+{
+        struct drm_connector *connector = &crtc->connector;
+        struct drm_mode_set set;
+        int ret;
+
+        memset(&set, 0, sizeof (set));
+        set.crtc = &crtc->drm_crtc;
+        if (saved->fb) {
+                set.fb = saved->fb;
+                set.mode = &saved->mode;
+                set.x = saved->x;
+                set.y = saved->y;
+                set.connectors = &connector;
+                set.num_connectors = 1;
+        }
+
+        ret = crtc->drm_crtc.funcs->set_config(&set);
+        if (ret)
+                DRM_ERROR("Failed to restore CRTC %d: %d\n",
+                          crtc->crtc_id, ret);
+}
+
+/**
+ * Apply the configuration of several CRTCs at once. Every CRTC is checked
+ * before any of them is touched. Modesets are applied first, and undone if
+ * one of them fails. Flips are queued last, once every modeset went
+ * through, and were checked against the current state of their CRTC: a flip
+ * can then only fail for lack of memory or GART space, in which case the
+ * modesets stay.
+ */
+int xengfx_atomic_ioctl(struct drm_device *dev, void *data,
+                        struct drm_file *file_priv)
+{
+        struct drm_xengfx_atomic *args = data;
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct drm_xengfx_crtc_state *states;
+        struct drm_framebuffer **fbs;
+        struct drm_display_mode *modes;
+        struct xengfx_atomic_saved *saved;
+        unsigned long *seen;
+        unsigned long *enabled;
+        int ret = 0;
+        int i, j;
+
+        if (args->flags & ~(XENGFX_ATOMIC_TEST_ONLY | XENGFX_ATOMIC_NONBLOCK))
+                return -EINVAL;
+
+        if (args->count == 0)
+                return 0;
+        if (args->count > dev_priv->crtc_count)
+                return -EINVAL;
+
+        states = kcalloc(args->count, sizeof (*states), GFP_KERNEL);
+        fbs = kcalloc(args->count, sizeof (*fbs), GFP_KERNEL);
+        modes = kcalloc(args->count, sizeof (*modes), GFP_KERNEL);
+        saved = kcalloc(args->count, sizeof (*saved), GFP_KERNEL);
+        /* The device decides how many CRTCs there are */
+        seen = kcalloc(BITS_TO_LONGS(dev_priv->crtc_count), sizeof (long),
+                       GFP_KERNEL);
+        enabled = kcalloc(BITS_TO_LONGS(dev_priv->crtc_count), sizeof (long),
+                          GFP_KERNEL);
+        if (!states || !fbs || !modes || !saved || !seen || !enabled) {
+                ret = -ENOMEM;
+                goto out_free;
+        }
+
+        if (copy_from_user(states,
+                           (void __user *)(unsigned long)args->states,
+                           args->count * sizeof (*states))) {
+                ret = -EFAULT;
+                goto out_free;
+        }
+
+        mutex_lock(&dev->mode_config.mutex);
+
+        /* Check */
+        for (i = 0; i < args->count; i++) {
+                struct drm_xengfx_crtc_state *state = &states[i];
+                struct xengfx_crtc *crtc;
+
+                if (state->crtc >= dev_priv->crtc_count ||
+                    !dev_priv->crtcs[state->crtc] ||
+                    test_bit(state->crtc, seen) ||
+                    (state->flags & ~XENGFX_CRTC_STATE_FLAGS) ||
+                    state->pad) {
+                        ret = -EINVAL;
+                        goto out_unlock;
+                }
+                set_bit(state->crtc, seen);
+                crtc = dev_priv->crtcs[state->crtc];
+
+                if (state->flags & XENGFX_CRTC_STATE_FLIP) {
+                        ret = xengfx_atomic_check_flip(crtc, state, &fbs[i]);
+                        if (ret)
+                                goto out_unlock;
+                        continue;
+                }
+                if (state->flags) {
+                        ret = -EINVAL;
+                        goto out_unlock;
+                }
+
+                if (state->fb_id) {
+                        struct drm_mode_object *obj;
+
+                        obj = drm_mode_object_find(dev, state->fb_id,
+                                                   DRM_MODE_OBJECT_FB);
+                        if (!obj) {
+                                ret = -EINVAL;
+                                goto out_unlock;
+                        }
+                        fbs[i] = obj_to_fb(obj);
+                        xengfx_mode_from_umode(&modes[i], &state->mode);
+                        drm_mode_set_crtcinfo(&modes[i], CRTC_INTERLACE_HALVE_V);
+                }
+
+                ret = xengfx_crtc_check(crtc, fbs[i], &modes[i],
+                                        state->x, state->y);
+                if (ret)
+                        goto out_unlock;
+        }
+
+        if (args->flags & XENGFX_ATOMIC_TEST_ONLY)
+                goto out_unlock;
+
+        /* Commit the modesets, undoing them all if one fails */
+        for (i = 0; i < args->count; i++) {
+                struct drm_xengfx_crtc_state *state = &states[i];
+                struct xengfx_crtc *crtc = dev_priv->crtcs[state->crtc];
+                struct drm_connector *connector = &crtc->connector;
+                struct drm_mode_set set;
+
+                if (state->flags & XENGFX_CRTC_STATE_FLIP)
+                        continue;
+
+                xengfx_atomic_save(crtc, &saved[i]);
+
+                memset(&set, 0, sizeof (set));
+                set.crtc = &crtc->drm_crtc;
+                if (fbs[i]) {
+                        set.fb = fbs[i];
+                        set.mode = &modes[i];
+                        set.x = state->x;
+                        set.y = state->y;
+                        set.connectors = &connector;
+                        set.num_connectors = 1;
+                }
+
+                ret = crtc->drm_crtc.funcs->set_config(&set);
+                if (ret) {
+                        DRM_ERROR("Failed to commit CRTC %d: %d\n",
+                                  crtc->crtc_id, ret);
+                        for (j = i - 1; j >= 0; j--) {
+                                if (states[j].flags & XENGFX_CRTC_STATE_FLIP)
+                                        continue;
+                                xengfx_atomic_restore(dev_priv->crtcs[states[j].crtc],
+                                                      &saved[j]);
+                        }
+                        goto out_unlock;
+                }
+
+                if (crtc->active)
+                        set_bit(crtc->crtc_id, enabled);
+        }
+
+        /* Then queue the flips */
+        for (i = 0; i < args->count; i++) {
+                struct drm_xengfx_crtc_state *state = &states[i];
+                struct xengfx_crtc *crtc = dev_priv->crtcs[state->crtc];
+
+                if (!(state->flags & XENGFX_CRTC_STATE_FLIP))
+                        continue;
+
+                ret = xengfx_atomic_commit_flip(crtc, state, fbs[i], file_priv);
+                if (ret) {
+                        DRM_ERROR("Failed to flip CRTC %d: %d\n",
+                                  crtc->crtc_id, ret);
+                        break;
+                }
+
+                set_bit(crtc->crtc_id, enabled);
+        }
+
+out_unlock:
+        mutex_unlock(&dev->mode_config.mutex);
+
+        if (!ret && !(args->flags & XENGFX_ATOMIC_NONBLOCK)) {
+                for (i = 0; i < dev_priv->crtc_count; i++) {
+                        if (test_bit(i, enabled))
+                                xengfx_crtc_wait_vblank(dev, i);
+                }
+        }
+out_free:
+        kfree(enabled);
+        kfree(seen);
+        kfree(saved);
+        kfree(modes);
+        kfree(fbs);
+        kfree(states);
+
+        return ret;
+}
+
 /* Modesetting part */
 
 static void xengfx_disable_vga(struct drm_device *dev)
@@ -640,6 +2570,34 @@ void xengfx_modeset_init(struct drm_device *dev)
 
         dev->mode_config.fb_base = dev_priv->aper_base;
 
+        INIT_LIST_HEAD(&dev_priv->edid_modes);
+
+        spin_lock_init(&dev_priv->onscreen_lock);
+        INIT_WORK(&dev_priv->onscreen_work, xengfx_onscreen_work_func);
+        mutex_init(&dev_priv->onscreen_mutex);
+        /* fbdev starts running */
+        dev_priv->fbdev_onscreen = true;
+
+        /* Read-only, follows XGFX_VCRTC_STATUS_ONSCREEN */
+        dev_priv->onscreen_property =
+                drm_property_create(dev, DRM_MODE_PROP_RANGE |
+                                    DRM_MODE_PROP_IMMUTABLE, "onscreen", 2);
+        if (dev_priv->onscreen_property) {
+                dev_priv->onscreen_property->values[0] = 0;
+                dev_priv->onscreen_property->values[1] = 1;
+        }
+
+        if (dev_priv->caps & XGFX_CAPS_SCALING)
+                drm_mode_create_scaling_mode_property(dev);
+
+        /* In Hz, 0 for the rate of the mode */
+        dev_priv->refresh_property =
+                drm_property_create(dev, DRM_MODE_PROP_RANGE, "refresh", 2);
+        if (dev_priv->refresh_property) {
+                dev_priv->refresh_property->values[0] = 0;
+                dev_priv->refresh_property->values[1] = XENGFX_MAX_REFRESH;
+        }
+
         ncrtc = xengfx_mmio_read(dev_priv, XGFX_NVCRTC);
         dev_priv->crtcs = kzalloc(sizeof(*dev_priv->crtcs) * ncrtc, GFP_KERNEL);
         if (!dev_priv->crtcs)
@@ -657,6 +2615,10 @@ void xengfx_modeset_init(struct drm_device *dev)
 
 void xengfx_modeset_cleanup(struct drm_device *dev)
 {
+        /* Make sure no flip is left holding a buffer */
+        flush_scheduled_work();
+
+        xengfx_edid_modes_cleanup(dev);
         drm_mode_config_cleanup(dev);
 }
 
@@ -72,11 +72,34 @@ static int xengfx_pm_suspend(struct device *dev)
 static int xengfx_pm_resume(struct device *dev)
 {
         struct pci_dev *pdev = to_pci_dev(dev);
+        struct drm_device *drm_dev = pci_get_drvdata(pdev);
+        struct xengfx_private *dev_priv = drm_dev->dev_private;
+        int ret;
+        int i;
+
+        /* The device model may have lost its state, don't trust our shadow */
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                if (dev_priv->crtcs[i])
+                        xengfx_crtc_regs_reset(dev_priv->crtcs[i]);
+        }
 
         pci_set_power_state(pdev, PCI_D0);
         pci_restore_state(pdev);
 
-        return pci_enable_device(pdev);
+        ret = pci_enable_device(pdev);
+        if (ret)
+                return ret;
+
+        /* Shared pages are registered again, before events can use them */
+        xengfx_status_resume(drm_dev);
+        xengfx_damage_resume(drm_dev);
+        xengfx_stage_resume(drm_dev);
+
+        /* Interrupt enables are read-modify-written, program them again */
+        if (drm_dev->irq_enabled)
+                xengfx_irq_postinstall(drm_dev);
+
+        return 0;
 }
 
 static const struct dev_pm_ops xengfx_pm_ops = {
@@ -115,6 +138,11 @@ static int xengfx_driver_load(struct drm_device *dev, unsigned long driver_data)
         dev_priv->rev = xengfx_mmio_read(dev_priv, XGFX_REV);
         DRM_INFO("Found XenGFX device Rev %d\n", dev_priv->rev);
 
+        /* Older device models don't implement the capability register */
+        dev_priv->caps = xengfx_mmio_read(dev_priv, XGFX_CAPS);
+        if (dev_priv->caps == 0xffffffff)
+                dev_priv->caps = 0;
+
         /* Reset device before using it */
         xengfx_mmio_read(dev_priv, XGFX_RESET);
 
@@ -124,6 +152,8 @@ static int xengfx_driver_load(struct drm_device *dev, unsigned long driver_data)
 		DRM_ERROR("Failed to initialize vblank\n");
                 goto err_vblank;
         }
+        /* Our retrace counters are full 32 bits */
+        dev->max_vblank_count = 0xffffffff;
 
         /* XGFX_GART_SIZE reports gart_size in number of pages */
         gart_size = xengfx_mmio_read(dev_priv, XGFX_GART_SIZE);
@@ -149,7 +179,19 @@ static int xengfx_driver_load(struct drm_device *dev, unsigned long driver_data)
         /* Initialize CRTCs and outputs */
         xengfx_modeset_init(dev);
 
-        error = drm_irq_install(dev);
+        error = xengfx_status_init(dev);
+        if (error)
+                goto err_status;
+
+        error = xengfx_damage_init(dev);
+        if (error)
+                goto err_damage;
+
+        error = xengfx_stage_init(dev);
+        if (error)
+                goto err_stage;
+
+        error = xengfx_irq_setup(dev);
         if (error) {
                 DRM_ERROR("Failed to install IRQ handler");
                 goto err_irqinstall;
@@ -158,13 +200,21 @@ static int xengfx_driver_load(struct drm_device *dev, unsigned long driver_data)
         error = xengfx_fbdev_init(dev);
         if (error)
                 goto err_fbdev;
+        xengfx_onscreen_init(dev);
 
         DRM_KMS_HELPER_POLL_INIT(dev);
 
         return 0;
 err_fbdev:
-        drm_irq_uninstall(dev);
+        xengfx_irq_teardown(dev);
+        xengfx_onscreen_fini(dev);
 err_irqinstall:
+        xengfx_stage_fini(dev);
+err_stage:
+        xengfx_damage_fini(dev);
+err_damage:
+        xengfx_status_fini(dev);
+err_status:
         xengfx_modeset_cleanup(dev);
         drm_mm_takedown(&dev_priv->gart_mm);
         drm_mm_takedown(&dev_priv->stolen_mm);
@@ -180,8 +230,14 @@ static int xengfx_driver_unload(struct drm_device *dev)
 {
         struct xengfx_private *dev_priv = dev->dev_private;
 
+        DRM_KMS_HELPER_POLL_FINI(dev);
+
         /* XXX: Move this to lastclose ? */
-        drm_irq_uninstall(dev);
+        xengfx_irq_teardown(dev);
+        xengfx_onscreen_fini(dev);
+        xengfx_stage_fini(dev);
+        xengfx_damage_fini(dev);
+        xengfx_status_fini(dev);
 
         xengfx_fbdev_cleanup(dev);
 
@@ -244,9 +300,39 @@ static struct vm_operations_struct xengfx_gem_vm_ops = {
         .close = drm_gem_vm_close
 };
 
+static int xengfx_getparam_ioctl(struct drm_device *dev, void *data,
+                                 struct drm_file *file_priv)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct drm_xengfx_getparam *args = data;
+
+        switch (args->param) {
+        case XENGFX_PARAM_CAPS:
+                args->value = XENGFX_CAP_ATOMIC |
+                              XENGFX_CAP_MAILBOX_FLIP |
+                              XENGFX_CAP_FB_FORMAT |
+                              XENGFX_CAP_CRTC_INFO;
+                /* Bypassing the retrace takes a COMMIT_NOW */
+                if (dev_priv->stage)
+                        args->value |= XENGFX_CAP_ASYNC_FLIP;
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
 static struct drm_ioctl_desc xengfx_ioctls[] = {
         DRM_IOCTL_DEF_DRV(XENGFX_GEM_CREATE, xengfx_gem_create_ioctl, DRM_UNLOCKED),
         DRM_IOCTL_DEF_DRV(XENGFX_GEM_MAP, xengfx_gem_map_ioctl, DRM_UNLOCKED),
+        DRM_IOCTL_DEF_DRV(XENGFX_ATOMIC, xengfx_atomic_ioctl,
+                          DRM_MASTER | DRM_CONTROL_ALLOW | DRM_UNLOCKED),
+        DRM_IOCTL_DEF_DRV(XENGFX_GETPARAM, xengfx_getparam_ioctl, DRM_UNLOCKED),
+        DRM_IOCTL_DEF_DRV(XENGFX_FB_FORMAT, xengfx_fb_format_ioctl,
+                          DRM_CONTROL_ALLOW | DRM_UNLOCKED),
+        DRM_IOCTL_DEF_DRV(XENGFX_CRTC_INFO, xengfx_crtc_info_ioctl,
+                          DRM_CONTROL_ALLOW | DRM_UNLOCKED),
 };
 
 static int __devinit xengfx_pci_probe(struct pci_dev *pdev,
@@ -264,7 +350,6 @@ static void xengfx_pci_remove(struct pci_dev *pdev)
 
 static struct drm_driver xengfx_drm_driver = {
         .driver_features =
-            DRIVER_HAVE_IRQ | DRIVER_IRQ_SHARED |
             DRIVER_MODESET | DRIVER_GEM,
         .load = xengfx_driver_load,
         .unload = xengfx_driver_unload,
@@ -277,13 +362,8 @@ static struct drm_driver xengfx_drm_driver = {
         .disable_vblank = xengfx_disable_vblank,
 
         GET_SCANOUT_POSITION_IMPLEMENTATION
-        // We don't implement the callback so drm thinks we do not support the vblank queries
-        //.get_vblank_timestamp = xengfx_get_vblank_timestamp,
 
-        .irq_preinstall = xengfx_irq_preinstall,
-	.irq_postinstall = xengfx_irq_postinstall,
-	.irq_uninstall = xengfx_irq_uninstall,
-	.irq_handler = xengfx_irq_handler,
+        /* Interrupts are requested by xengfx_irq_setup() */
 
         .master_create = xengfx_master_create,
         .master_destroy = xengfx_master_destroy,
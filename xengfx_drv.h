@@ -39,7 +39,7 @@
 #define DRIVER_DATE "20110606"
 
 #define DRIVER_MAJOR 1
-#define DRIVER_MINOR 4
+#define DRIVER_MINOR 8
 #define DRIVER_PATCHLEVEL 0
 
 #define XENGFX_VENDOR_ID 0x5853
@@ -47,30 +47,176 @@
 
 #define XGFX_EDID_LEN               256
 
+/* Default mode when the display has no usable EDID */
+#define XENGFX_DEFAULT_WIDTH        1024
+#define XENGFX_DEFAULT_HEIGHT       768
+
+/* Highest value of the refresh property, 0 meaning the rate of the mode */
+#define XENGFX_MAX_REFRESH          240
+
 struct xengfx_file_private {
         int dummy;
 };
 
+struct xengfx_gem_object;
+
+/* Flip modes for xengfx_crtc_queue_flip() */
+#define XENGFX_FLIP_QUEUED          0
+#define XENGFX_FLIP_MAILBOX         1
+#define XENGFX_FLIP_ASYNC           2
+
+/* A flip waiting for the device to latch the new base at retrace */
+struct xengfx_flip {
+        struct work_struct work;
+        struct drm_device *dev;
+        struct drm_pending_vblank_event *event;
+
+        /* Buffer to scan out, pinned */
+        struct xengfx_gem_object *obj;
+        /* Buffer to unpin once the flip is retired, referenced */
+        struct xengfx_gem_object *old_obj;
+        /* Retraces counted before the base was written */
+        u32 retrace_seq;
+};
+
+#define XENGFX_CURSOR_CACHE_SIZE    4
+
+/* A cursor image pinned into the aperture */
+struct xengfx_cursor {
+        struct xengfx_gem_object *obj;
+        unsigned long last_used;
+};
+
+/*
+ * Shadow copy of the CRTC registers used on hot paths, every MMIO access
+ * being a trap to the device model.
+ */
+struct xengfx_crtc_regs {
+        /* Read-only registers, fetched again after hotplug or reset */
+        bool valid;
+        u32 max_horizontal;
+        u32 max_vertical;
+        u32 stride_alignment;
+        u32 valid_format;
+
+        /*
+         * Interrupt enables, updated bit by bit: always what the device
+         * should have, written back by xengfx_irq_postinstall()
+         */
+        u32 status_int;
+
+        /* Registers only written by the driver, ~0 until first written */
+        u32 h_active;
+        u32 v_active;
+        u32 format;
+        u32 stride;
+        u32 h_total;
+        u32 h_sync_start;
+        u32 h_sync_end;
+        u32 v_total;
+        u32 v_sync_start;
+        u32 v_sync_end;
+        u32 pixel_clock;
+        u32 refresh;
+        u32 source_size;
+        u32 scaling;
+        u32 uv_stride;
+        u32 lineoffset;
+};
+
 struct xengfx_crtc {
         struct drm_crtc drm_crtc;
 
         int crtc_id;
 
+        struct xengfx_crtc_regs regs;
+        /* Writes in the stage block, not committed yet */
+        int stage_count;
+
         struct drm_connector connector;
 
-        unsigned long first_rescan;
         bool active;
 
+        /* Is the host displaying this CRTC ? */
+        bool onscreen;
+
+        /* Software retrace counter, when the device doesn't provide one */
+        u32 retrace_count;
+        ktime_t vblank_off_time;
+        u64 frame_ns;
+        u32 vdisplay;
+        u32 vtotal;
+
+        /* Mode frame duration and clock, and refresh rate asked by userspace */
+        u64 mode_frame_ns;
+        int mode_clock;
+        unsigned int refresh;
+
+        /* Scaling mode property, XGFX_SCALING_* */
+        unsigned int scaling;
+
+        /* Predicted retraces, when the device reports the scanline */
+        bool vblank_enabled;
+        struct hrtimer vblank_timer;
+        bool vblank_timer_on;
+        /* Bumped whenever the timer is started or stopped */
+        unsigned int vblank_timer_gen;
+        unsigned int vblank_resync;
+
+        /* Last EDID fetched, see xengfx_get_edid() */
         u8 edid[XGFX_EDID_LEN];
+        bool edid_valid;
+        bool edid_changed;
+        u32 edid_generation;
+        u32 edid_crc;
+        bool edid_pending;
+        wait_queue_head_t edid_wait;
         u32 base;
+        u32 uv_base;
+
+        /* Latched by the hard interrupt handler for the interrupt thread */
+        unsigned long irq_change;
+        u32 irq_status;
+
+        /* Reprobe after a hotplug event, see xengfx_crtc_status_connected() */
+        struct delayed_work hotplug_work;
+
+        /* Last frame signalled to the device, see xengfx_crtc_frame_done() */
+        atomic_t frame_seq;
+
+        /* Pending flip, protected by dev->event_lock */
+        struct xengfx_flip *flip;
+
+        bool cursor_supported;
+        bool cursor_visible;
+        u32 cursor_max_width;
+        u32 cursor_max_height;
+        u32 cursor_base;
+        u32 cursor_size;
+        u32 cursor_pos;
+        unsigned long cursor_serial;
+        struct xengfx_cursor cursor_cache[XENGFX_CURSOR_CACHE_SIZE];
 };
 
 struct xengfx_fbdev;
 
+#define XENGFX_EDID_MODES_CACHE_SIZE 8
+
+/* Mode list parsed from an EDID, so that it is parsed only once */
+struct xengfx_edid_modes {
+        struct list_head head;
+        u32 crc;
+        u8 edid[XGFX_EDID_LEN];
+        struct list_head modes;
+        int width_mm;
+        int height_mm;
+};
+
 struct xengfx_private {
         struct drm_device *dev;
 
         unsigned int rev;
+        u32 caps;
 
         void __iomem *mmio;
         unsigned int gart_size;
@@ -88,8 +234,43 @@ struct xengfx_private {
 
         struct xengfx_fbdev *fbdev;
         struct drm_encoder encoder;
+        struct drm_property *onscreen_property;
+        struct drm_property *refresh_property;
+
+        /* Onscreen state of the CRTCs, see xengfx_onscreen_work_func() */
+        spinlock_t onscreen_lock;
+        struct work_struct onscreen_work;
+        struct mutex onscreen_mutex;
+        bool fbdev_onscreen;
+
+        /* Modes parsed from recent EDIDs, see xengfx_connector_get_modes() */
+        struct list_head edid_modes;
+        int edid_modes_count;
+
+        /* Interrupt delivery, see xengfx_irq_setup() */
+        int irq_mode;
+        struct msix_entry *msix_entries;
+        int msix_count;
+
+        /* Shared status page, if the device supports it */
+        struct page *status_pg;
+        struct xgfx_status_page *status_page;
+
+        /* Damage ring, if the device supports it */
+        struct page *damage_pg;
+        struct xgfx_damage_ring *damage_ring;
+        spinlock_t damage_lock;
+
+        /* Stage blocks, if the device supports them, see xengfx_crtc_stage() */
+        struct page *stage_pg;
+        struct xgfx_stage_block *stage;
+        spinlock_t stage_lock;
 };
 
+#define XENGFX_IRQ_INTX             0
+#define XENGFX_IRQ_MSI              1
+#define XENGFX_IRQ_MSIX             2
+
 /* This structure represents a range in the device GART */
 struct xengfx_gem_object {
         struct drm_gem_object gem_object;
@@ -111,11 +292,19 @@ struct xengfx_gem_object {
 struct xengfx_framebuffer {
         struct drm_framebuffer drm_fb;
         struct xengfx_gem_object *obj;
+
+        /* YUV layout set with DRM_IOCTL_XENGFX_FB_FORMAT, format 0 if RGB */
+        u32 format;
+        u32 offsets[2];
+        u32 pitches[2];
 };
 
 struct xengfx_fbdev {
         struct drm_fb_helper helper;
         struct xengfx_framebuffer fb;
+
+        /* Damage from console drawing, reported in batches */
+        struct delayed_work flush_work;
 };
 
 #define to_xengfx_crtc(x) container_of(x, struct xengfx_crtc, drm_crtc)
@@ -135,6 +324,54 @@ static inline void xengfx_mmio_write(struct xengfx_private *dev_priv,
     writel(val, dev_priv->mmio + offset);
 }
 
+static inline void xengfx_crtc_write(struct xengfx_private *dev_priv,
+                                     u32 *shadow, unsigned int offset,
+                                     u32 val)
+{
+        if (*shadow == val)
+                return;
+
+        *shadow = val;
+        xengfx_mmio_write(dev_priv, offset, val);
+}
+
+/* xengfx_stage.c */
+int xengfx_stage_init(struct drm_device *dev);
+void xengfx_stage_resume(struct drm_device *dev);
+void xengfx_stage_fini(struct drm_device *dev);
+void xengfx_crtc_stage_write(struct xengfx_crtc *crtc, unsigned int offset,
+                             u32 val);
+void xengfx_crtc_flush(struct xengfx_crtc *crtc);
+void xengfx_crtc_flush_now(struct xengfx_crtc *crtc);
+
+/*
+ * Same as xengfx_crtc_write() for a register that the device can latch at
+ * retrace. The write is held back until xengfx_crtc_flush() if the device
+ * has stage blocks.
+ */
+static inline void xengfx_crtc_stage(struct xengfx_crtc *crtc, u32 *shadow,
+                                     unsigned int offset, u32 val)
+{
+        if (*shadow == val)
+                return;
+
+        *shadow = val;
+        xengfx_crtc_stage_write(crtc, offset, val);
+}
+
+void xengfx_crtc_regs_fetch(struct xengfx_private *dev_priv,
+                            struct xengfx_crtc *crtc);
+void xengfx_crtc_regs_reset(struct xengfx_crtc *crtc);
+
+static inline struct xengfx_crtc_regs *
+xengfx_crtc_regs(struct xengfx_private *dev_priv, struct xengfx_crtc *crtc)
+{
+        if (!crtc->regs.valid)
+                xengfx_crtc_regs_fetch(dev_priv, crtc);
+
+        return &crtc->regs;
+}
+
 /* xengfx_gem.c */
 int xengfx_gem_init_object(struct drm_gem_object *obj);
 void xengfx_gem_free_object(struct drm_gem_object *gem_obj);
@@ -159,21 +396,63 @@ irqreturn_t xengfx_irq_handler(DRM_IRQ_ARGS);
 void xengfx_irq_preinstall(struct drm_device *dev);
 int xengfx_irq_postinstall(struct drm_device *dev);
 void xengfx_irq_uninstall(struct drm_device *dev);
+int xengfx_irq_setup(struct drm_device *dev);
+void xengfx_irq_teardown(struct drm_device *dev);
+void xengfx_crtc_retrace(struct xengfx_crtc *crtc);
+void xengfx_vblank_timer_init(struct xengfx_crtc *crtc);
+void xengfx_vblank_timer_fini(struct xengfx_crtc *crtc);
+void xengfx_vblank_restart(struct xengfx_crtc *crtc);
 /* xengfx_display.c */
 struct edid *xengfx_get_edid(struct drm_connector *connector, void *);
 void xengfx_modeset_init(struct drm_device *dev);
 void xengfx_modeset_cleanup(struct drm_device *dev);
-void xengfx_crtc_status_onscreen(struct xengfx_crtc *crtc, int enable);
+void xengfx_onscreen_init(struct drm_device *dev);
+void xengfx_onscreen_fini(struct drm_device *dev);
+void xengfx_crtc_status_onscreen(struct xengfx_crtc *crtc);
 void xengfx_crtc_status_connected(struct xengfx_crtc *crtc, int enable);
+void xengfx_crtc_status_edid(struct xengfx_crtc *crtc);
+void xengfx_crtc_finish_flip(struct xengfx_crtc *crtc);
+void xengfx_crtc_frame_done(struct xengfx_crtc *crtc);
+int xengfx_crtc_queue_flip(struct drm_crtc *drm_crtc,
+                           struct drm_framebuffer *drm_fb,
+                           struct drm_pending_vblank_event *event,
+                           int mode);
 int xengfx_framebuffer_init(struct drm_device *dev,
                             struct xengfx_framebuffer *xengfx_fb,
                             struct drm_mode_fb_cmd *mode_cmd,
                             struct xengfx_gem_object *obj);
 u32 xengfx_stride_align(struct xengfx_crtc *crtc, u32 stride);
+u32 xengfx_pitch_align(struct xengfx_private *dev_priv, u32 stride);
 int xengfx_stride_valid(struct xengfx_crtc *crtc, u32 stride);
 int xengfx_bpp_valid(struct xengfx_crtc *crtc, u32 bpp);
+int xengfx_atomic_ioctl(struct drm_device *dev, void *data,
+                        struct drm_file *file_priv);
+int xengfx_fb_format_ioctl(struct drm_device *dev, void *data,
+                           struct drm_file *file_priv);
+int xengfx_crtc_info_ioctl(struct drm_device *dev, void *data,
+                           struct drm_file *file_priv);
+void xengfx_fb_damage(struct drm_framebuffer *drm_fb,
+                      struct drm_clip_rect *clips, unsigned num_clips,
+                      unsigned inc);
+/* xengfx_status.c */
+int xengfx_status_init(struct drm_device *dev);
+void xengfx_status_resume(struct drm_device *dev);
+void xengfx_status_fini(struct drm_device *dev);
+u32 xengfx_status_fetch_isr(struct xengfx_private *dev_priv);
+u32 xengfx_status_fetch_pending(struct xengfx_private *dev_priv, int n);
+u32 xengfx_status_fetch_change(struct xengfx_private *dev_priv, int crtc,
+                               u32 *status);
+void xengfx_status_ack(struct xengfx_private *dev_priv);
+u32 xengfx_status_scanline(struct xengfx_private *dev_priv, int crtc);
+/* xengfx_damage.c */
+int xengfx_damage_init(struct drm_device *dev);
+void xengfx_damage_resume(struct drm_device *dev);
+void xengfx_damage_fini(struct drm_device *dev);
+void xengfx_damage_push(struct xengfx_private *dev_priv, int crtc,
+                        struct drm_clip_rect *rects, int count);
 /* xengfx_fb.c */
 int xengfx_fbdev_init(struct drm_device *dev);
 void xengfx_fbdev_cleanup(struct drm_device *dev);
+void xengfx_fbdev_set_onscreen(struct drm_device *dev, bool onscreen);
 
 #endif /* XENGFX_IOCTL_H_ */
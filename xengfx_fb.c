@@ -46,13 +46,52 @@ static void xengfx_fb_gamma_get(struct drm_crtc *crtc, u16 *red, u16 *green,
     /* I doubt we are going to implement this */
 }
 
+/* Console drawing is reported at most this often */
+#define XENGFX_FBDEV_FLUSH_DELAY    msecs_to_jiffies(20)
+
+static void xengfx_fbdev_flush_work_func(struct work_struct *work)
+{
+        struct xengfx_fbdev *fbdev = container_of(work, struct xengfx_fbdev,
+                                                  flush_work.work);
+
+        xengfx_fb_damage(&fbdev->fb.drm_fb, NULL, 0, 1);
+}
+
+static void xengfx_fbdev_dirty(struct fb_info *info)
+{
+        struct xengfx_fbdev *fbdev = info->par;
+
+        schedule_delayed_work(&fbdev->flush_work, XENGFX_FBDEV_FLUSH_DELAY);
+}
+
+static void xengfx_fb_fillrect(struct fb_info *info,
+                               const struct fb_fillrect *rect)
+{
+        cfb_fillrect(info, rect);
+        xengfx_fbdev_dirty(info);
+}
+
+static void xengfx_fb_copyarea(struct fb_info *info,
+                               const struct fb_copyarea *area)
+{
+        cfb_copyarea(info, area);
+        xengfx_fbdev_dirty(info);
+}
+
+static void xengfx_fb_imageblit(struct fb_info *info,
+                                const struct fb_image *image)
+{
+        cfb_imageblit(info, image);
+        xengfx_fbdev_dirty(info);
+}
+
 struct fb_ops xengfx_fb_ops = {
         .owner = THIS_MODULE,
         .fb_check_var = drm_fb_helper_check_var,
         .fb_set_par = drm_fb_helper_set_par,
-        .fb_fillrect = cfb_fillrect,
-        .fb_copyarea = cfb_copyarea,
-        .fb_imageblit = cfb_imageblit,
+        .fb_fillrect = xengfx_fb_fillrect,
+        .fb_copyarea = xengfx_fb_copyarea,
+        .fb_imageblit = xengfx_fb_imageblit,
         .fb_pan_display = drm_fb_helper_pan_display,
         .fb_blank = drm_fb_helper_blank,
         .fb_setcmap = drm_fb_helper_setcmap,
@@ -75,10 +114,34 @@ int xengfx_fbdev_init(struct drm_device *dev)
                 return -ENOMEM;
 
         dev_priv->fbdev = fbdev;
+        INIT_DELAYED_WORK(&fbdev->flush_work, xengfx_fbdev_flush_work_func);
 
         return xengfx_fbdev_init_compat(dev);
 }
 
+/*
+ * Stop console drawing while no CRTC is displayed, the console is redrawn
+ * when one is again.
+ */
+void xengfx_fbdev_set_onscreen(struct drm_device *dev, bool onscreen)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_fbdev *fbdev = dev_priv->fbdev;
+        struct fb_info *info;
+
+        if (!fbdev)
+                return;
+
+        info = fbdev_to_fb_info(fbdev);
+        if (!info)
+                return;
+
+        XENGFX_CONSOLE_LOCK();
+        fb_set_suspend(info, onscreen ? FBINFO_STATE_RUNNING :
+                                        FBINFO_STATE_SUSPENDED);
+        XENGFX_CONSOLE_UNLOCK();
+}
+
 void xengfx_fbdev_cleanup(struct drm_device *dev)
 {
         struct xengfx_private *dev_priv = dev->dev_private;
@@ -88,6 +151,8 @@ void xengfx_fbdev_cleanup(struct drm_device *dev)
         if (!fbdev)
                 return;
 
+        cancel_delayed_work_sync(&fbdev->flush_work);
+
         info = fbdev_to_fb_info(fbdev);
 
         if (info) {
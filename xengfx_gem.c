@@ -427,8 +427,11 @@ xengfx_gem_create_ioctl(struct drm_device *dev,
                         struct drm_file *file_priv)
 {
         struct drm_xengfx_gem_create *args = data;
+        struct xengfx_private *dev_priv = dev->dev_private;
 
-        args->pitch = ALIGN(args->width * ((args->bpp + 7) / 8), 128);
+        /* Any CRTC can scan the buffer out with that pitch */
+        args->pitch = xengfx_pitch_align(dev_priv,
+                                         args->width * ((args->bpp + 7) / 8));
         args->size = args->pitch * args->height;
         return xengfx_gem_create(file_priv, dev, args->size, &args->handle);
 }
@@ -50,11 +50,118 @@ struct drm_xengfx_gem_map {
         uint64_t offset;
 };
 
+/*
+ * Per-CRTC state for DRM_IOCTL_XENGFX_ATOMIC. A null fb_id disables the CRTC,
+ * otherwise the CRTC scans out fb_id at (x, y) using mode.
+ */
+struct drm_xengfx_crtc_state {
+        // IN
+        uint32_t crtc;
+        uint32_t fb_id;
+        uint32_t x;
+        uint32_t y;
+        uint32_t flags;
+        uint32_t pad;
+        uint64_t user_data;
+        struct drm_mode_modeinfo mode;
+};
+
+/* Flip to fb_id, keeping the current mode and position of the CRTC */
+#define XENGFX_CRTC_STATE_FLIP          (1 << 0)
+/* Replace a flip still pending on the CRTC instead of failing with EBUSY */
+#define XENGFX_CRTC_STATE_MAILBOX       (1 << 1)
+/* Send a DRM_EVENT_FLIP_COMPLETE carrying user_data once the flip is done */
+#define XENGFX_CRTC_STATE_EVENT         (1 << 2)
+/* Scan out at once rather than at retrace, tearing; replaces a pending flip */
+#define XENGFX_CRTC_STATE_ASYNC         (1 << 3)
+#define XENGFX_CRTC_STATE_FLAGS         (XENGFX_CRTC_STATE_FLIP |       \
+                                         XENGFX_CRTC_STATE_MAILBOX |    \
+                                         XENGFX_CRTC_STATE_EVENT |      \
+                                         XENGFX_CRTC_STATE_ASYNC)
+
+/* Only check the configuration, don't apply it */
+#define XENGFX_ATOMIC_TEST_ONLY         (1 << 0)
+/* Don't wait for the next vblank before returning */
+#define XENGFX_ATOMIC_NONBLOCK          (1 << 1)
+
+struct drm_xengfx_atomic {
+        // IN
+        uint64_t states;        /* Pointer to an array of drm_xengfx_crtc_state */
+        uint32_t count;
+        uint32_t flags;
+};
+
+/* Parameters for DRM_IOCTL_XENGFX_GETPARAM */
+#define XENGFX_PARAM_CAPS               0x1
+#define   XENGFX_CAP_ATOMIC                     (1 << 0)
+#define   XENGFX_CAP_MAILBOX_FLIP               (1 << 1)
+#define   XENGFX_CAP_ASYNC_FLIP                 (1 << 2)
+#define   XENGFX_CAP_FB_FORMAT                  (1 << 3)
+#define   XENGFX_CAP_CRTC_INFO                  (1 << 4)
+
+/*
+ * Scanout layout of a framebuffer for DRM_IOCTL_XENGFX_FB_FORMAT. The
+ * planes are in the buffer object of the framebuffer, at the given offsets.
+ * RGB brings the framebuffer back to the format given by its depth, with
+ * components in BGR order, RGB_ORDER selects the RGB order at that depth.
+ */
+#define XENGFX_FB_FORMAT_RGB            0
+#define XENGFX_FB_FORMAT_YUYV           1
+#define XENGFX_FB_FORMAT_NV12           2
+#define XENGFX_FB_FORMAT_RGB_ORDER      3
+
+struct drm_xengfx_fb_format {
+        // IN
+        uint32_t fb_id;
+        uint32_t format;
+        uint32_t offsets[2];
+        uint32_t pitches[2];
+};
+
+/* Scanout formats of a CRTC, for DRM_IOCTL_XENGFX_CRTC_INFO */
+#define XENGFX_FORMAT_RGB555            (1 << 0)
+#define XENGFX_FORMAT_BGR555            (1 << 1)
+#define XENGFX_FORMAT_RGB565            (1 << 2)
+#define XENGFX_FORMAT_BGR565            (1 << 3)
+#define XENGFX_FORMAT_RGB888            (1 << 4)
+#define XENGFX_FORMAT_BGR888            (1 << 5)
+#define XENGFX_FORMAT_RGB8888           (1 << 6)
+#define XENGFX_FORMAT_BGR8888           (1 << 7)
+#define XENGFX_FORMAT_YUYV              (1 << 8)
+#define XENGFX_FORMAT_NV12              (1 << 9)
+
+struct drm_xengfx_crtc_info {
+        // IN
+        uint32_t crtc_id;
+        uint32_t pad;
+
+        // OUT
+        uint32_t formats;
+        uint32_t stride_alignment;      /* in bytes, a power of two */
+};
+
+struct drm_xengfx_getparam {
+        // IN
+        uint32_t param;
+        uint32_t pad;
+
+        // OUT
+        uint64_t value;
+};
+
 
 #define DRM_XENGFX_GEM_CREATE   0x0
 #define DRM_XENGFX_GEM_MAP      0x1
+#define DRM_XENGFX_ATOMIC       0x2
+#define DRM_XENGFX_GETPARAM     0x3
+#define DRM_XENGFX_FB_FORMAT    0x4
+#define DRM_XENGFX_CRTC_INFO    0x5
 
 #define DRM_IOCTL_XENGFX_GEM_CREATE     DRM_IOWR(DRM_COMMAND_BASE + DRM_XENGFX_GEM_CREATE, struct drm_xengfx_gem_create)
 #define DRM_IOCTL_XENGFX_GEM_MAP        DRM_IOWR(DRM_COMMAND_BASE + DRM_XENGFX_GEM_MAP, struct drm_xengfx_gem_map)
+#define DRM_IOCTL_XENGFX_ATOMIC         DRM_IOW(DRM_COMMAND_BASE + DRM_XENGFX_ATOMIC, struct drm_xengfx_atomic)
+#define DRM_IOCTL_XENGFX_GETPARAM       DRM_IOWR(DRM_COMMAND_BASE + DRM_XENGFX_GETPARAM, struct drm_xengfx_getparam)
+#define DRM_IOCTL_XENGFX_FB_FORMAT      DRM_IOW(DRM_COMMAND_BASE + DRM_XENGFX_FB_FORMAT, struct drm_xengfx_fb_format)
+#define DRM_IOCTL_XENGFX_CRTC_INFO      DRM_IOWR(DRM_COMMAND_BASE + DRM_XENGFX_CRTC_INFO, struct drm_xengfx_crtc_info)
 
 #endif /* XENGFX_IOCTL_H_ */
@@ -27,60 +27,203 @@
  *
  **************************************************************************/
 
+#include <linux/module.h>
 #include "drmP.h"
 #include "xengfx_drv.h"
 #include "xengfx_reg.h"
 
-irqreturn_t xengfx_irq_handler(DRM_IRQ_ARGS)
+static int msi = 1;
+module_param(msi, int, 0400);
+MODULE_PARM_DESC(msi, "Use MSI-X or MSI interrupts when available (default: 1)");
+
+static int vblank_timer = 1;
+module_param(vblank_timer, int, 0400);
+MODULE_PARM_DESC(vblank_timer,
+                 "Predict retraces from the scanline instead of taking an "
+                 "interrupt for each of them (default: 1)");
+
+/* Frames between two resynchronisations of the vblank timer */
+#define XENGFX_VBLANK_RESYNC        60
+
+/* Deliver a retrace, whether it was signalled or predicted */
+void xengfx_crtc_retrace(struct xengfx_crtc *xengfx_crtc)
 {
-        struct drm_device *dev = arg;
-	struct xengfx_private *dev_priv = dev->dev_private;
-        u32 isr;
-        irqreturn_t ret = IRQ_NONE;
-        struct drm_crtc *crtc;
+        drm_handle_vblank(xengfx_crtc->drm_crtc.dev, xengfx_crtc->crtc_id);
+        xengfx_crtc_finish_flip(xengfx_crtc);
+}
 
-        isr = xengfx_mmio_read(dev_priv, XGFX_ISR);
-        if (!isr)
-                return IRQ_NONE;
+/*
+ * Bottom half: everything which doesn't need to happen with interrupts off,
+ * i.e. all of it. Called from the interrupt thread.
+ */
+static void xengfx_crtc_handle_events(struct xengfx_crtc *xengfx_crtc)
+{
+        unsigned long change;
+        u32 status;
+        int enable;
+
+        change = xchg(&xengfx_crtc->irq_change, 0);
+        if (!change)
+                return;
+        status = ACCESS_ONCE(xengfx_crtc->irq_status);
+
+        if (change & XGFX_VCRTC_STATUS_ONSCREEN)
+                xengfx_crtc_status_onscreen(xengfx_crtc);
+
+        if (change & XGFX_VCRTC_STATUS_HOTPLUG) {
+                enable = status & XGFX_VCRTC_STATUS_HOTPLUG;
+                xengfx_crtc_status_connected(xengfx_crtc, enable);
+        }
+
+        if (change & XGFX_VCRTC_STATUS_EDID)
+                xengfx_crtc_status_edid(xengfx_crtc);
+
+        if (change & XGFX_VCRTC_STATUS_RETRACE)
+                xengfx_crtc_retrace(xengfx_crtc);
+}
+
+/* Top half: remember what happened for the interrupt thread */
+static void xengfx_crtc_latch_events(struct xengfx_crtc *xengfx_crtc,
+                                     u32 status, u32 change)
+{
+        int bit;
+
+        if (change & XGFX_VCRTC_STATUS_HOTPLUG) {
+                /* Limits may have changed with the new display */
+                xengfx_crtc->regs.valid = false;
+        }
+
+        if (change & XGFX_VCRTC_STATUS_RETRACE)
+                xengfx_crtc->retrace_count++;
+
+        xengfx_crtc->irq_status = status;
+        for (bit = 0; bit < 32; bit++) {
+                if (change & (1U << bit))
+                        set_bit(bit, &xengfx_crtc->irq_change);
+        }
+}
 
-        list_for_each_entry(crtc, &dev->mode_config.crtc_list, head) {
-                struct xengfx_crtc *xengfx_crtc = to_xengfx_crtc(crtc);
-                int crtc_id = xengfx_crtc->crtc_id;
-                u32 status, change;
-                int enable;
+static irqreturn_t xengfx_irq_latch_crtc(struct xengfx_private *dev_priv,
+                                         int crtc_id)
+{
+        struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc_id];
+        u32 status, change;
 
+        if (dev_priv->status_page) {
+                change = xengfx_status_fetch_change(dev_priv, crtc_id, &status);
+        } else {
                 status = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id,
                                                                STATUS));
                 change = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc_id,
                                                                STATUS_CHANGE));
 
-                if (change & XGFX_VCRTC_STATUS_ONSCREEN) {
-                        enable = status & XGFX_VCRTC_STATUS_ONSCREEN;
-                        xengfx_crtc_status_onscreen(xengfx_crtc, enable);
-                        ret = IRQ_HANDLED;
-                }
+                /* Clear status for this CRTC */
+                xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, STATUS_CHANGE),
+                                  change);
+        }
 
-                if (change & XGFX_VCRTC_STATUS_HOTPLUG) {
-                        enable = status & XGFX_VCRTC_STATUS_HOTPLUG;
-                        xengfx_crtc_status_connected(xengfx_crtc, enable);
-                        ret = IRQ_HANDLED;
-                }
+        if (xengfx_crtc == NULL || !change)
+                return IRQ_NONE;
+
+        xengfx_crtc_latch_events(xengfx_crtc, status, change);
+
+        return IRQ_WAKE_THREAD;
+}
+
+/*
+ * Only visit the CRTCs the device reports events for, so that the cost of
+ * an interrupt doesn't grow with the number of heads.
+ */
+static irqreturn_t xengfx_irq_latch_pending(struct xengfx_private *dev_priv)
+{
+        irqreturn_t ret = IRQ_HANDLED;
+        int n;
 
-                if (change & XGFX_VCRTC_STATUS_RETRACE) {
-                        drm_handle_vblank(dev, crtc_id);
-                        ret = IRQ_HANDLED;
+        for (n = 0; n < DIV_ROUND_UP(dev_priv->crtc_count, 32); n++) {
+                u32 pending;
+
+                if (dev_priv->status_page)
+                        pending = xengfx_status_fetch_pending(dev_priv, n);
+                else
+                        pending = xengfx_mmio_read(dev_priv,
+                                                   XGFX_CRTC_PENDING(n));
+
+                while (pending) {
+                        int crtc_id = n * 32 + __ffs(pending);
+
+                        pending &= pending - 1;
+                        if (crtc_id >= dev_priv->crtc_count)
+                                break;
+
+                        if (xengfx_irq_latch_crtc(dev_priv, crtc_id))
+                                ret = IRQ_WAKE_THREAD;
                 }
+        }
 
-                /* Clear status for this CRTC */
-                xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc_id, STATUS_CHANGE),
-                                  change);
+        return ret;
+}
+
+static irqreturn_t xengfx_irq_latch_all(struct xengfx_private *dev_priv)
+{
+        irqreturn_t ret = IRQ_HANDLED;
+        int crtc_id;
+
+        for (crtc_id = 0; crtc_id < dev_priv->crtc_count; crtc_id++) {
+                if (xengfx_irq_latch_crtc(dev_priv, crtc_id))
+                        ret = IRQ_WAKE_THREAD;
         }
 
-        xengfx_mmio_write(dev_priv, XGFX_ISR, isr);
+        return ret;
+}
+
+/*
+ * The hard interrupt handler only latches and acknowledges the status, the
+ * work is left to xengfx_irq_thread(). With a status page, everything is
+ * read from memory and a single write acknowledges the interrupt.
+ */
+irqreturn_t xengfx_irq_handler(DRM_IRQ_ARGS)
+{
+        struct drm_device *dev = arg;
+	struct xengfx_private *dev_priv = dev->dev_private;
+        u32 isr;
+        irqreturn_t ret;
+
+        if (dev_priv->status_page)
+                isr = xengfx_status_fetch_isr(dev_priv);
+        else
+                isr = xengfx_mmio_read(dev_priv, XGFX_ISR);
+        if (!isr)
+                return IRQ_NONE;
+
+        /* The bitmap covers XGFX_CRTC_PENDING_COUNT * 32 CRTCs at most */
+        if ((dev_priv->caps & XGFX_CAPS_CRTC_PENDING) &&
+            dev_priv->crtc_count <= XGFX_CRTC_PENDING_COUNT * 32)
+                ret = xengfx_irq_latch_pending(dev_priv);
+        else
+                ret = xengfx_irq_latch_all(dev_priv);
+
+        if (dev_priv->status_page)
+                xengfx_status_ack(dev_priv);
+        else
+                xengfx_mmio_write(dev_priv, XGFX_ISR, isr);
 
         return ret;
 }
 
+static irqreturn_t xengfx_irq_thread(int irq, void *arg)
+{
+        struct drm_device *dev = arg;
+	struct xengfx_private *dev_priv = dev->dev_private;
+        int crtc_id;
+
+        for (crtc_id = 0; crtc_id < dev_priv->crtc_count; crtc_id++) {
+                if (dev_priv->crtcs[crtc_id])
+                        xengfx_crtc_handle_events(dev_priv->crtcs[crtc_id]);
+        }
+
+        return IRQ_HANDLED;
+}
+
 void xengfx_irq_preinstall(struct drm_device *dev)
 {
 
@@ -89,29 +232,43 @@ void xengfx_irq_preinstall(struct drm_device *dev)
 int xengfx_irq_postinstall(struct drm_device *dev)
 {
 	struct xengfx_private *dev_priv = dev->dev_private;
+        u32 status_int = XGFX_VCRTC_STATUS_HOTPLUG | XGFX_VCRTC_STATUS_ONSCREEN;
         int crtc;
         u32 val;
 
+        if (dev_priv->caps & XGFX_CAPS_EDID_INT)
+                status_int |= XGFX_VCRTC_STATUS_EDID;
+
         for (crtc = 0; crtc < dev->num_crtcs; crtc++) {
+                struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
                 u32 status;
 
+                if (xengfx_crtc == NULL)
+                        continue;
+
                 /* Clear CRTC status change register */
                 status = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, STATUS_CHANGE));
                 xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc, STATUS_CHANGE),
                                   status);
 
                 /*
-                 * Enable HOTPLUG and ONSCREEN interrupts, RETRACE is enabled
-                 * independantly by the vblank DRM code.
+                 * Enable HOTPLUG, ONSCREEN and EDID interrupts, RETRACE is
+                 * enabled independantly by the vblank DRM code. Always
+                 * written, the device may have lost it on resume.
                  */
+                xengfx_crtc->regs.status_int = status_int |
+                        (xengfx_crtc->regs.status_int &
+                         XGFX_VCRTC_STATUS_RETRACE);
                 xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc, STATUS_INT),
-                                  XGFX_VCRTC_STATUS_HOTPLUG |
-                                  XGFX_VCRTC_STATUS_ONSCREEN);
+                                  xengfx_crtc->regs.status_int);
         }
 
         xengfx_mmio_write(dev_priv, XGFX_ISR, 0);
         val = xengfx_mmio_read(dev_priv, XGFX_CONTROL);
-        xengfx_mmio_write(dev_priv, XGFX_CONTROL, val | XGFX_CONTROL_INT_EN);
+        val |= XGFX_CONTROL_INT_EN;
+        if (dev_priv->irq_mode == XENGFX_IRQ_MSIX)
+                val |= XGFX_CONTROL_MSIX_EN;
+        xengfx_mmio_write(dev_priv, XGFX_CONTROL, val);
 	return 0;
 }
 
@@ -121,55 +278,458 @@ void xengfx_irq_uninstall(struct drm_device *dev)
         u32 val;
 
         val = xengfx_mmio_read(dev_priv, XGFX_CONTROL);
-        xengfx_mmio_write(dev_priv, XGFX_CONTROL, val & ~XGFX_CONTROL_INT_EN);
+        val &= ~(XGFX_CONTROL_INT_EN | XGFX_CONTROL_MSIX_EN);
+        xengfx_mmio_write(dev_priv, XGFX_CONTROL, val);
 
         xengfx_mmio_write(dev_priv, XGFX_ISR, 0);
 }
 
-u32 xengfx_get_vblank_counter(struct drm_device *dev, int crtc)
+/* MSI-X vector n + 1 only ever signals the retrace of CRTC n */
+static irqreturn_t xengfx_irq_retrace_handler(int irq, void *arg)
+{
+        struct xengfx_crtc *xengfx_crtc = arg;
+
+        xengfx_crtc->retrace_count++;
+        set_bit(ilog2(XGFX_VCRTC_STATUS_RETRACE), &xengfx_crtc->irq_change);
+
+        return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t xengfx_irq_retrace_thread(int irq, void *arg)
+{
+        xengfx_crtc_handle_events(arg);
+
+        return IRQ_HANDLED;
+}
+
+static void xengfx_irq_free(struct drm_device *dev, int count)
 {
 	struct xengfx_private *dev_priv = dev->dev_private;
-        struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
+        int i;
 
-        if (xengfx_crtc == NULL)
-                return -EINVAL;
+        if (dev_priv->irq_mode != XENGFX_IRQ_MSIX) {
+                free_irq(dev->pdev->irq, dev);
+                return;
+        }
 
-        if (!xengfx_crtc->first_rescan)
-                return -EINVAL;
+        for (i = 0; i < count; i++) {
+                void *arg = i ? (void *)dev_priv->crtcs[i - 1] : (void *)dev;
+
+                free_irq(dev_priv->msix_entries[i].vector, arg);
+        }
+}
+
+static int xengfx_irq_request_msix(struct drm_device *dev)
+{
+	struct xengfx_private *dev_priv = dev->dev_private;
+        int ret;
+        int i;
+
+        ret = request_threaded_irq(dev_priv->msix_entries[0].vector,
+                                   xengfx_irq_handler, xengfx_irq_thread,
+                                   0, DRIVER_NAME, dev);
+        if (ret)
+                return ret;
+
+        for (i = 1; i < dev_priv->msix_count; i++) {
+                ret = request_threaded_irq(dev_priv->msix_entries[i].vector,
+                                           xengfx_irq_retrace_handler,
+                                           xengfx_irq_retrace_thread,
+                                           0, DRIVER_NAME,
+                                           dev_priv->crtcs[i - 1]);
+                if (ret) {
+                        xengfx_irq_free(dev, i);
+                        return ret;
+                }
+        }
 
-        /* Lets assume we rescan 60 times a second */
-        return ((xengfx_crtc->first_rescan - jiffies) * 60) / HZ;
+        return 0;
 }
 
-int xengfx_enable_vblank(struct drm_device *dev, int crtc)
+static int xengfx_irq_enable_msix(struct drm_device *dev)
+{
+	struct xengfx_private *dev_priv = dev->dev_private;
+        int nvec = dev_priv->crtc_count + 1;
+        int ret;
+        int i;
+
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                if (!dev_priv->crtcs[i])
+                        return -ENODEV;
+        }
+
+        dev_priv->msix_entries = kcalloc(nvec, sizeof (struct msix_entry),
+                                         GFP_KERNEL);
+        if (!dev_priv->msix_entries)
+                return -ENOMEM;
+
+        for (i = 0; i < nvec; i++)
+                dev_priv->msix_entries[i].entry = i;
+
+        /* Don't bother with fewer vectors than CRTCs, MSI will do */
+        ret = pci_enable_msix(dev->pdev, dev_priv->msix_entries, nvec);
+        if (ret) {
+                kfree(dev_priv->msix_entries);
+                dev_priv->msix_entries = NULL;
+                return ret < 0 ? ret : -ENOSPC;
+        }
+
+        dev_priv->irq_mode = XENGFX_IRQ_MSIX;
+        dev_priv->msix_count = nvec;
+
+        return 0;
+}
+
+static void xengfx_irq_disable_msi(struct drm_device *dev)
+{
+	struct xengfx_private *dev_priv = dev->dev_private;
+
+        switch (dev_priv->irq_mode) {
+        case XENGFX_IRQ_MSIX:
+                pci_disable_msix(dev->pdev);
+                kfree(dev_priv->msix_entries);
+                dev_priv->msix_entries = NULL;
+                dev_priv->msix_count = 0;
+                break;
+        case XENGFX_IRQ_MSI:
+                pci_disable_msi(dev->pdev);
+                break;
+        }
+
+        dev_priv->irq_mode = XENGFX_IRQ_INTX;
+}
+
+/*
+ * Prefer MSI-X with a vector per CRTC, so that retrace interrupts aren't
+ * shared and don't need to be identified. Each vector can also be steered
+ * to a different CPU through /proc/irq. Fall back to MSI, then to INTx.
+ *
+ * Hotplug, onscreen and EDID events stay on vector 0. They are rare, and
+ * their handler reads the status of the CRTC anyway to learn the new state,
+ * so a vector of their own would save nothing but an XGFX_ISR read, at the
+ * cost of up to three more vectors per CRTC.
+ *
+ * drm_irq_install() can't do threaded handlers nor multiple vectors, so
+ * the interrupts are requested here and the vblank code is told directly.
+ */
+int xengfx_irq_setup(struct drm_device *dev)
 {
 	struct xengfx_private *dev_priv = dev->dev_private;
-        u32 status_int;
+        int ret;
+
+        dev_priv->irq_mode = XENGFX_IRQ_INTX;
 
-        status_int = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, STATUS_INT));
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc, STATUS_INT),
-                          status_int | XGFX_VCRTC_STATUS_RETRACE);
+        if (msi && (dev_priv->caps & XGFX_CAPS_MSIX_VECTORS) &&
+            pci_find_capability(dev->pdev, PCI_CAP_ID_MSIX)) {
+                ret = xengfx_irq_enable_msix(dev);
+                if (ret)
+                        DRM_DEBUG_DRIVER("MSI-X unavailable: %d\n", ret);
+        }
+
+        if (msi && dev_priv->irq_mode == XENGFX_IRQ_INTX &&
+            !pci_enable_msi(dev->pdev))
+                dev_priv->irq_mode = XENGFX_IRQ_MSI;
+
+        xengfx_irq_preinstall(dev);
+
+        if (dev_priv->irq_mode == XENGFX_IRQ_MSIX)
+                ret = xengfx_irq_request_msix(dev);
+        else
+                ret = request_threaded_irq(dev->pdev->irq, xengfx_irq_handler,
+                                           xengfx_irq_thread,
+                                           dev_priv->irq_mode == XENGFX_IRQ_INTX ?
+                                           IRQF_SHARED : 0,
+                                           DRIVER_NAME, dev);
+        if (ret) {
+                xengfx_irq_disable_msi(dev);
+                return ret;
+        }
+
+        DRM_INFO("Using %s interrupts\n",
+                 dev_priv->irq_mode == XENGFX_IRQ_MSIX ? "MSI-X" :
+                 dev_priv->irq_mode == XENGFX_IRQ_MSI ? "MSI" : "INTx");
+
+        dev->irq_enabled = 1;
+        xengfx_irq_postinstall(dev);
 
         return 0;
 }
 
-void xengfx_disable_vblank(struct drm_device *dev, int crtc)
+void xengfx_irq_teardown(struct drm_device *dev)
+{
+	struct xengfx_private *dev_priv = dev->dev_private;
+        int i;
+
+        if (!dev->irq_enabled)
+                return;
+        dev->irq_enabled = 0;
+
+        /* Wake up any waiter, as drm_irq_uninstall() would */
+        for (i = 0; i < dev->num_crtcs; i++)
+                DRM_WAKEUP(&dev->vbl_queue[i]);
+
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                if (dev_priv->crtcs[i])
+                        xengfx_vblank_timer_fini(dev_priv->crtcs[i]);
+        }
+
+        xengfx_irq_uninstall(dev);
+        xengfx_irq_free(dev, dev_priv->msix_count);
+        xengfx_irq_disable_msi(dev);
+}
+
+/*
+ * Retraces are counted by the driver whatever signals them: the interrupt
+ * handler, or the vblank timer which also stands in for the retrace
+ * interrupt. The frames elapsed while neither ran are accounted for when
+ * vblank is turned back on. The count in the status page only follows the
+ * retrace interrupt, so it isn't used.
+ */
+u32 xengfx_get_vblank_counter(struct drm_device *dev, int crtc)
 {
 	struct xengfx_private *dev_priv = dev->dev_private;
-        u32 status_int;
+        struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
+
+        if (xengfx_crtc == NULL)
+                return 0;
+
+        return ACCESS_ONCE(xengfx_crtc->retrace_count);
+}
+
+/*
+ * Time until the next retrace, i.e. until the scanline reaches vdisplay.
+ * Returns 0 if the device doesn't report the scanline.
+ */
+static u64 xengfx_vblank_timer_next(struct xengfx_crtc *xengfx_crtc)
+{
+	struct xengfx_private *dev_priv = xengfx_crtc->drm_crtc.dev->dev_private;
+        u32 vtotal = xengfx_crtc->vtotal;
+        u64 line_ns, next;
+        u32 scanline;
+
+        if (!vtotal || !xengfx_crtc->frame_ns)
+                return 0;
+
+        scanline = xengfx_status_scanline(dev_priv, xengfx_crtc->crtc_id);
+        if (scanline == 0xffffffff || scanline >= vtotal)
+                return 0;
+
+        line_ns = div_u64(xengfx_crtc->frame_ns, vtotal);
+        next = ((xengfx_crtc->vdisplay + vtotal - scanline) % vtotal) * line_ns;
+
+        /*
+         * Too close to a retrace, assume it's the one being handled: the
+         * timer may well have fired a little early.
+         */
+        if (next < xengfx_crtc->frame_ns / 2)
+                next += xengfx_crtc->frame_ns;
+
+        return next;
+}
+
+/*
+ * Time left until the retrace that the timer predicted, if the scanline says
+ * the device didn't reach it yet. Returns 0 once it went by, or if the device
+ * doesn't report the scanline.
+ */
+static u64 xengfx_vblank_timer_early(struct xengfx_crtc *xengfx_crtc)
+{
+        struct xengfx_private *dev_priv = xengfx_crtc->drm_crtc.dev->dev_private;
+        u32 vtotal = xengfx_crtc->vtotal;
+        u32 scanline, lines;
+
+        if (!vtotal || !xengfx_crtc->frame_ns)
+                return 0;
+
+        scanline = xengfx_status_scanline(dev_priv, xengfx_crtc->crtc_id);
+        if (scanline == 0xffffffff || scanline >= vtotal)
+                return 0;
 
-        status_int = xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, STATUS_INT));
-        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc, STATUS_INT),
-                          status_int & ~XGFX_VCRTC_STATUS_RETRACE);
+        /* More than half a frame away, it's the next one: this one went by */
+        lines = (xengfx_crtc->vdisplay + vtotal - scanline) % vtotal;
+        if (lines >= vtotal / 2)
+                return 0;
+
+        return lines * div_u64(xengfx_crtc->frame_ns, vtotal);
+}
+
+/* Frame duration divisor while the CRTC is not displayed by the host */
+#define XENGFX_VBLANK_OFFSCREEN_DIV 15
+
+/*
+ * Predicted retrace. The timer runs at the frame rate of the mode and is
+ * brought back in phase with the scanline every XENGFX_VBLANK_RESYNC frames,
+ * which is a memory read with a status page. While the CRTC is offscreen,
+ * nobody sees the frames and the timer only fires every
+ * XENGFX_VBLANK_OFFSCREEN_DIV frames to throttle rendering. Each fire then
+ * still counts as a single retrace, like the vblank DRM delivers for it, so
+ * that retrace_count and the DRM counter stay in step.
+ *
+ * A predicted retrace completes the pending flip like a real one, so it must
+ * not come before the device latched the base: with a flip pending, the
+ * scanline is checked first and an early timer waits for the real retrace.
+ *
+ * xengfx_vblank_source_off() can't wait for a running callback, so the
+ * timer may be started again while it runs. The callback thus never
+ * returns HRTIMER_RESTART, which would enqueue the timer a second time, but
+ * starts it again itself unless it was stopped or restarted meanwhile.
+ */
+static enum hrtimer_restart xengfx_vblank_timer_func(struct hrtimer *timer)
+{
+        struct xengfx_crtc *xengfx_crtc =
+                container_of(timer, struct xengfx_crtc, vblank_timer);
+        unsigned int gen = ACCESS_ONCE(xengfx_crtc->vblank_timer_gen);
+        unsigned int frames = 1;
+        ktime_t expires, now;
+        u64 early = 0;
+        u64 next = 0;
+        u64 period, late;
+
+        smp_rmb();
+        if (!ACCESS_ONCE(xengfx_crtc->vblank_timer_on))
+                return HRTIMER_NORESTART;
+
+        if (!xengfx_crtc->onscreen)
+                frames = XENGFX_VBLANK_OFFSCREEN_DIV;
+
+        if (ACCESS_ONCE(xengfx_crtc->flip))
+                early = xengfx_vblank_timer_early(xengfx_crtc);
+
+        if (early) {
+                /* Back in phase with the scanline, no resync needed */
+                xengfx_crtc->vblank_resync = 0;
+                next = early;
+        } else {
+                xengfx_crtc->retrace_count++;
+                xengfx_crtc_retrace(xengfx_crtc);
+
+                if (frames == 1 &&
+                    ++xengfx_crtc->vblank_resync >= XENGFX_VBLANK_RESYNC) {
+                        xengfx_crtc->vblank_resync = 0;
+                        next = xengfx_vblank_timer_next(xengfx_crtc);
+                }
+        }
+
+        now = ktime_get();
+        if (next) {
+                expires = ktime_add_ns(now, next);
+        } else {
+                /* Same as hrtimer_forward_now(), without touching the timer */
+                period = xengfx_crtc->frame_ns * frames;
+                expires = ktime_add_ns(hrtimer_get_expires(timer), period);
+                if (period && expires.tv64 <= now.tv64) {
+                        late = ktime_to_ns(ktime_sub(now, expires));
+                        expires = ktime_add_ns(expires,
+                                               (div64_u64(late, period) + 1) *
+                                               period);
+                }
+        }
+
+        smp_rmb();
+        if (gen != ACCESS_ONCE(xengfx_crtc->vblank_timer_gen) ||
+            !ACCESS_ONCE(xengfx_crtc->vblank_timer_on))
+                return HRTIMER_NORESTART;
+
+        hrtimer_start(timer, expires, HRTIMER_MODE_ABS);
+
+        return HRTIMER_NORESTART;
+}
+
+static bool xengfx_vblank_timer_start(struct xengfx_crtc *xengfx_crtc)
+{
+        u64 next;
+
+        /* No need to follow the scanline while offscreen */
+        if (!xengfx_crtc->onscreen && xengfx_crtc->frame_ns)
+                next = xengfx_crtc->frame_ns * XENGFX_VBLANK_OFFSCREEN_DIV;
+        else if (vblank_timer)
+                next = xengfx_vblank_timer_next(xengfx_crtc);
+        else
+                next = 0;
+
+        if (!next)
+                return false;
+
+        xengfx_crtc->vblank_resync = 0;
+        xengfx_crtc->vblank_timer_gen++;
+        smp_wmb();
+        xengfx_crtc->vblank_timer_on = true;
+        hrtimer_start(&xengfx_crtc->vblank_timer, ns_to_ktime(next),
+                      HRTIMER_MODE_REL);
+
+        return true;
+}
+
+void xengfx_vblank_timer_init(struct xengfx_crtc *xengfx_crtc)
+{
+        hrtimer_init(&xengfx_crtc->vblank_timer, CLOCK_MONOTONIC,
+                     HRTIMER_MODE_REL);
+        xengfx_crtc->vblank_timer.function = xengfx_vblank_timer_func;
+}
+
+void xengfx_vblank_timer_fini(struct xengfx_crtc *xengfx_crtc)
+{
+        xengfx_crtc->vblank_timer_on = false;
+        hrtimer_cancel(&xengfx_crtc->vblank_timer);
+}
+
+/*
+ * Retraces are predicted by a timer when the device reports the scanline,
+ * which saves an interrupt per frame. The retrace interrupt is only used
+ * otherwise. Called with dev->vbl_lock held.
+ */
+static void xengfx_vblank_source_on(struct xengfx_crtc *xengfx_crtc)
+{
+	struct xengfx_private *dev_priv = xengfx_crtc->drm_crtc.dev->dev_private;
+        u32 *status_int = &xengfx_crtc->regs.status_int;
+
+        if (xengfx_vblank_timer_start(xengfx_crtc))
+                return;
+
+        xengfx_crtc_write(dev_priv, status_int,
+                          XGFX_VCRTC(xengfx_crtc->crtc_id, STATUS_INT),
+                          *status_int | XGFX_VCRTC_STATUS_RETRACE);
 }
 
-// Basic implementation of get_vblank_timestamp for drm_driver struct
-// in case we would need it
+static void xengfx_vblank_source_off(struct xengfx_crtc *xengfx_crtc)
+{
+	struct xengfx_private *dev_priv = xengfx_crtc->drm_crtc.dev->dev_private;
+        u32 *status_int = &xengfx_crtc->regs.status_int;
+
+        /*
+         * Don't wait for the timer callback with the lock held, it stops by
+         * itself once vblank_timer_on is cleared or the generation changed.
+         */
+        if (xengfx_crtc->vblank_timer_on) {
+                xengfx_crtc->vblank_timer_on = false;
+                xengfx_crtc->vblank_timer_gen++;
+                smp_wmb();
+                hrtimer_try_to_cancel(&xengfx_crtc->vblank_timer);
+        }
 
-#if 0
-int xengfx_get_vblank_timestamp(struct drm_device *dev, int crtc,
-                                int *max_error, struct timeval *vblank_time,
-			        unsigned flags)
+        xengfx_crtc_write(dev_priv, status_int,
+                          XGFX_VCRTC(xengfx_crtc->crtc_id, STATUS_INT),
+                          *status_int & ~XGFX_VCRTC_STATUS_RETRACE);
+}
+
+/*
+ * The vblank source and the timer period depend on the onscreen state and
+ * the frame rate, restart it when either changes.
+ */
+void xengfx_vblank_restart(struct xengfx_crtc *xengfx_crtc)
+{
+        struct drm_device *dev = xengfx_crtc->drm_crtc.dev;
+        unsigned long flags;
+
+        spin_lock_irqsave(&dev->vbl_lock, flags);
+        if (xengfx_crtc->vblank_enabled) {
+                xengfx_vblank_source_off(xengfx_crtc);
+                xengfx_vblank_source_on(xengfx_crtc);
+        }
+        spin_unlock_irqrestore(&dev->vbl_lock, flags);
+}
+
+int xengfx_enable_vblank(struct drm_device *dev, int crtc)
 {
 	struct xengfx_private *dev_priv = dev->dev_private;
         struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
@@ -177,8 +737,36 @@ int xengfx_get_vblank_timestamp(struct drm_device *dev, int crtc,
         if (xengfx_crtc == NULL)
                 return -EINVAL;
 
-        return drm_calc_vbltimestamp_from_scanoutpos(dev, crtc, max_error,
-                                                     vblank_time, flags,
-                                                     &xengfx_crtc->drm_crtc);
+        /*
+         * Catch up at the rate the timer would have counted, one retrace per
+         * XENGFX_VBLANK_OFFSCREEN_DIV frames while offscreen.
+         */
+        if (xengfx_crtc->vblank_off_time.tv64 && xengfx_crtc->frame_ns) {
+                ktime_t off = ktime_sub(ktime_get(), xengfx_crtc->vblank_off_time);
+                u64 period = xengfx_crtc->frame_ns;
+
+                if (!xengfx_crtc->onscreen)
+                        period *= XENGFX_VBLANK_OFFSCREEN_DIV;
+                xengfx_crtc->retrace_count += div64_u64(ktime_to_ns(off),
+                                                        period);
+        }
+
+        xengfx_crtc->vblank_enabled = true;
+        xengfx_vblank_source_on(xengfx_crtc);
+
+        return 0;
+}
+
+void xengfx_disable_vblank(struct drm_device *dev, int crtc)
+{
+	struct xengfx_private *dev_priv = dev->dev_private;
+        struct xengfx_crtc *xengfx_crtc = dev_priv->crtcs[crtc];
+
+        if (xengfx_crtc == NULL)
+                return;
+
+        xengfx_crtc->vblank_enabled = false;
+        xengfx_vblank_source_off(xengfx_crtc);
+
+        xengfx_crtc->vblank_off_time = ktime_get();
 }
-#endif
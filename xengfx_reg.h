@@ -33,12 +33,38 @@
 #define XGFX_MAGIC                  0x00000000
 #define   XGFX_MAGIC_VALID                      0x58464758
 #define XGFX_REV                    0x00000004
+#define XGFX_CAPS                   0x00000008
+#define   XGFX_CAPS_STATUS_PAGE                 (1 << 0)
+#define   XGFX_CAPS_CRTC_PENDING                (1 << 1)
+#define   XGFX_CAPS_MSIX_VECTORS                (1 << 2)
+/* Completion of EDID_REQUEST is signalled with STATUS_EDID */
+#define   XGFX_CAPS_EDID_INT                    (1 << 4)
+#define   XGFX_CAPS_DAMAGE_RING                 (1 << 5)
+#define   XGFX_CAPS_FRAME_SEQ                   (1 << 6)
+#define   XGFX_CAPS_TIMINGS                     (1 << 8)
+#define   XGFX_CAPS_SCALING                     (1 << 9)
+/* BASE is the origin of the framebuffer and LINEOFFSET the scanned out x, y */
+#define   XGFX_CAPS_LINEOFFSET                  (1 << 10)
+#define   XGFX_CAPS_STAGE                       (1 << 11)
 
 #define XGFX_CONTROL                0x00000100
 #define   XGFX_CONTROL_HIRES_EN                 (1 << 0)
 #define   XGFX_CONTROL_INT_EN                   (1 << 1)
+/*
+ * Signal the retrace of CRTC n on MSI-X vector n + 1, without reporting it in
+ * XGFX_ISR and STATUS_CHANGE. Everything else stays on vector 0.
+ */
+#define   XGFX_CONTROL_MSIX_EN                  (1 << 2)
 #define XGFX_ISR                    0x00000104
 #define   XGFX_ISR_INT                          (1 << 0)
+#define XGFX_STATUS_PAGE            0x00000110
+#define XGFX_STATUS_ACK             0x00000114
+#define XGFX_DAMAGE_RING            0x00000118
+#define XGFX_DAMAGE_DOORBELL        0x0000011C
+/* Bitmap of the CRTCs with a non-zero STATUS_CHANGE, 32 CRTCs per register */
+#define XGFX_CRTC_PENDING(n)        (0x00000120 + (n) * 4)
+#define   XGFX_CRTC_PENDING_COUNT               8
+#define XGFX_STAGE_PAGE             0x00000140
 
 #define XGFX_GART_SIZE              0x00000200
 #define XGFX_GART_INVAL             0x00000204
@@ -57,6 +83,8 @@
 #define   XGFX_VCRTC_STATUS_HOTPLUG             (1 << 0)
 #define   XGFX_VCRTC_STATUS_ONSCREEN            (1 << 1)
 #define   XGFX_VCRTC_STATUS_RETRACE             (1 << 2)
+#define   XGFX_VCRTC_STATUS_EDID                (1 << 3)
+/* From 0 to vtotal - 1, 0xffffffff if not implemented */
 #define XGFX_VCRTC_SCANLINE         0x0010000C
 #define XGFX_VCRTC_CURSOR_STATUS    0x00100010
 #define   XGFX_VCRTC_CURSOR_STATUS_SUPPORTED    (1 << 0)
@@ -69,9 +97,12 @@
 #define   XGFX_VCRTC_CURSOR_X_MASK              (0xffff << 16)
 #define   XGFX_VCRTC_CURSOR_X_SHIFT             16
 #define XGFX_VCRTC_CURSOR_BASE      0x00100020
+/* Same layout as CURSOR_SIZE, coordinates are signed 16 bits */
 #define XGFX_VCRTC_CURSOR_POS       0x00100024
 
 #define XGFX_VCRTC_EDID_REQUEST     0x00101000
+/* Bumped by the device when the EDID changes, 0xffffffff if not implemented */
+#define XGFX_VCRTC_EDID_GENERATION  0x00101004
 
 #define XGFX_VCRTC_CONTROL          0x00102000
 #define   XGFX_VCRTC_CONTROL_ENABLE             (1 << 0)
@@ -85,16 +116,65 @@
 #define   XGFX_FORMAT_BGR888                    (1 << 5)
 #define   XGFX_FORMAT_RGB8888                   (1 << 6)
 #define   XGFX_FORMAT_BGR8888                   (1 << 7)
+/* Packed 4:2:2, Y0 U Y1 V */
+#define   XGFX_FORMAT_YUYV                      (1 << 8)
+/* 4:2:0, Y plane at BASE and interleaved UV plane at UV_BASE */
+#define   XGFX_FORMAT_NV12                      (1 << 9)
 #define XGFX_VCRTC_MAX_HORIZONTAL   0x00102010
 #define XGFX_VCRTC_H_ACTIVE         0x00102014
 #define XGFX_VCRTC_MAX_VERTICAL     0x00102018
 #define XGFX_VCRTC_V_ACTIVE         0x0010201C
 #define XGFX_VCRTC_STRIDE_ALIGNMENT 0x00102020
 #define XGFX_VCRTC_STRIDE           0x00102024
+/*
+ * Full timings, with XGFX_CAPS_TIMINGS. Totals are minus one like the active
+ * sizes, sync positions start at 0, the pixel clock is in kHz.
+ */
+#define XGFX_VCRTC_H_TOTAL          0x00102028
+#define XGFX_VCRTC_H_SYNC_START     0x0010202C
+#define XGFX_VCRTC_H_SYNC_END       0x00102030
+#define XGFX_VCRTC_V_TOTAL          0x00102034
+#define XGFX_VCRTC_V_SYNC_START     0x00102038
+#define XGFX_VCRTC_V_SYNC_END       0x0010203C
+#define XGFX_VCRTC_PIXEL_CLOCK      0x00102040
+/* Rate at which the host scans out and copies the CRTC, in mHz */
+#define XGFX_VCRTC_REFRESH          0x00102044
+/*
+ * Size of the scanned out area minus one, with XGFX_CAPS_SCALING. The device
+ * fits it to the active size as SCALING says, the values being those of the
+ * DRM "scaling mode" property.
+ */
+#define XGFX_VCRTC_SOURCE_SIZE      0x00102048
+#define   XGFX_VCRTC_SOURCE_SIZE_Y_MASK         (0xffff << 0)
+#define   XGFX_VCRTC_SOURCE_SIZE_Y_SHIFT        0
+#define   XGFX_VCRTC_SOURCE_SIZE_X_MASK         (0xffff << 16)
+#define   XGFX_VCRTC_SOURCE_SIZE_X_SHIFT        16
+#define XGFX_VCRTC_SCALING          0x0010204C
+#define   XGFX_SCALING_NONE                     0
+#define   XGFX_SCALING_FULLSCREEN               1
+#define   XGFX_SCALING_CENTER                   2
+#define   XGFX_SCALING_ASPECT                   3
+#define XGFX_VCRTC_UV_STRIDE        0x00102050
 
 #define XGFX_VCRTC_BASE             0x00103000
+/* Written with an increasing sequence number whenever a frame is complete */
+#define XGFX_VCRTC_FRAME_SEQ        0x00103004
+/* Latched with BASE, which must be written last */
+#define XGFX_VCRTC_UV_BASE          0x00103008
+/* Number of entries of the stage block to apply, see struct xgfx_stage_block */
+#define XGFX_VCRTC_COMMIT           0x0010300C
+/* Apply them before the write completes rather than at the next retrace */
+#define   XGFX_VCRTC_COMMIT_NOW                 (1 << 31)
 
+/*
+ * Position of the scanned out area in the framebuffer at BASE, in pixels.
+ * Latched at the next retrace, the UV plane of NV12 is offset by x, y / 2.
+ */
 #define XGFX_VCRTC_LINEOFFSET       0x00104000
+#define   XGFX_VCRTC_LINEOFFSET_Y_MASK          (0xffff << 0)
+#define   XGFX_VCRTC_LINEOFFSET_Y_SHIFT         0
+#define   XGFX_VCRTC_LINEOFFSET_X_MASK          (0xffff << 16)
+#define   XGFX_VCRTC_LINEOFFSET_X_SHIFT         16
 #define XGFX_VCRTC_EDID             0x00105000
 
 #define XGFX_GART_BASE              0x00200000
@@ -104,4 +184,89 @@
                                                   (1 << XGFX_GART_BIT_RESERVED))
 #define   XGFX_GART_ENTRY_VALID                 (1 << XGFX_GART_BIT_USED)
 
+/*
+ * Status page, registered by writing its PFN to XGFX_STATUS_PAGE when
+ * XGFX_CAPS_STATUS_PAGE is set. The device ORs the bits it would have set in
+ * XGFX_ISR and XGFX_VCRTC_STATUS_CHANGE into isr and change, and keeps the
+ * other fields up to date. The driver clears the bits it consumed and
+ * writes XGFX_STATUS_ACK once to deassert the interrupt.
+ *
+ * The driver sets version to XGFX_STATUS_PAGE_VERSION before registering
+ * the page, so that later layouts can be told apart.
+ */
+#define XGFX_STATUS_PAGE_VERSION    1
+
+struct xgfx_status_crtc {
+        u32 status;
+        u32 change;
+        u32 scanline;
+        u32 retrace_count;
+};
+
+struct xgfx_status_page {
+        u32 isr;
+        u32 version;
+        u32 pad[6];
+        u32 pending[XGFX_CRTC_PENDING_COUNT];   /* Same as XGFX_CRTC_PENDING */
+        struct xgfx_status_crtc crtc[0];
+};
+
+#define XGFX_STATUS_PAGE_MAX_CRTCS                                      \
+        ((PAGE_SIZE - sizeof (struct xgfx_status_page)) /               \
+         sizeof (struct xgfx_status_crtc))
+
+/*
+ * Damage ring, registered by writing its PFN to XGFX_DAMAGE_RING when
+ * XGFX_CAPS_DAMAGE_RING is set. The driver adds rectangles at prod and
+ * writes prod to XGFX_DAMAGE_DOORBELL, the device copies them and advances
+ * cons. Rectangles are in framebuffer pixels relative to the origin of the
+ * scanned out area, i.e. within SOURCE_SIZE before any scaling, x2 and y2
+ * excluded. When the ring is full, the driver sets overflow instead and the
+ * device copies the whole frame of every CRTC before clearing it.
+ */
+#define XGFX_DAMAGE_RING_SIZE       256
+
+struct xgfx_damage_rect {
+        u16 crtc;
+        u16 x1;
+        u16 y1;
+        u16 x2;
+        u16 y2;
+        u16 pad;
+};
+
+struct xgfx_damage_ring {
+        u32 prod;
+        u32 cons;
+        u32 overflow;
+        u32 pad[13];
+        struct xgfx_damage_rect rect[XGFX_DAMAGE_RING_SIZE];
+};
+
+/*
+ * Stage blocks, registered by writing the PFN of physically contiguous pages
+ * to XGFX_STAGE_PAGE when XGFX_CAPS_STAGE is set, one block per CRTC. The
+ * driver fills the block of a CRTC with register writes and writes their
+ * number to XGFX_VCRTC_COMMIT. The device copies them then, so the block can
+ * be refilled at once, and applies them all, in order, at the next retrace
+ * of the CRTC. A disabled CRTC has no retrace and applies them as soon as
+ * COMMIT is written, including a write of CONTROL enabling it. A FRAME_SEQ
+ * written after COMMIT is for the committed state.
+ *
+ * A block holds a full CRTC update: one write to each register that can be
+ * staged, i.e. CONTROL, H_ACTIVE, V_ACTIVE, the 7 timings, REFRESH, FORMAT,
+ * STRIDE, UV_STRIDE, SOURCE_SIZE, SCALING, LINEOFFSET, UV_BASE and BASE, 20
+ * in all.
+ */
+#define XGFX_STAGE_ENTRIES          32
+
+struct xgfx_stage_entry {
+        u32 reg;                /* XGFX_VCRTC(c, reg) of the CRTC */
+        u32 val;
+};
+
+struct xgfx_stage_block {
+        struct xgfx_stage_entry entry[XGFX_STAGE_ENTRIES];
+};
+
 #endif /* _XENGFX_REG_H_ */
@@ -0,0 +1,185 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2011 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Julian Pidancet <julian.pidancet@gmail.com>
+ *
+ **************************************************************************/
+
+#include "drmP.h"
+#include "xengfx_drv.h"
+#include "xengfx_reg.h"
+
+static void xengfx_crtc_flush_locked(struct xengfx_private *dev_priv,
+                                     struct xengfx_crtc *crtc, u32 flags)
+{
+        if (!crtc->stage_count)
+                return;
+
+        /* Entries before the doorbell */
+        wmb();
+        xengfx_mmio_write(dev_priv, XGFX_VCRTC(crtc->crtc_id, COMMIT),
+                          crtc->stage_count | flags);
+        crtc->stage_count = 0;
+}
+
+/*
+ * Add a register write to the stage block of the CRTC. A register staged
+ * already only gets its value replaced, so a block holds at most one write
+ * to each register the device latches and never fills up. Without stage
+ * blocks, the register is written at once.
+ */
+void xengfx_crtc_stage_write(struct xengfx_crtc *crtc, unsigned int offset,
+                             u32 val)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        struct xgfx_stage_block *block;
+        struct xgfx_stage_entry *entry;
+        unsigned long flags;
+        int i;
+
+        if (!dev_priv->stage) {
+                xengfx_mmio_write(dev_priv, offset, val);
+                return;
+        }
+
+        spin_lock_irqsave(&dev_priv->stage_lock, flags);
+
+        block = &dev_priv->stage[crtc->crtc_id];
+        for (i = 0; i < crtc->stage_count; i++) {
+                if (block->entry[i].reg == offset) {
+                        block->entry[i].val = val;
+                        goto out;
+                }
+        }
+
+        /* Splitting the update would show it half applied */
+        if (WARN_ON_ONCE(crtc->stage_count == XGFX_STAGE_ENTRIES))
+                xengfx_crtc_flush_locked(dev_priv, crtc, 0);
+
+        entry = &block->entry[crtc->stage_count++];
+        entry->reg = offset;
+        entry->val = val;
+
+out:
+        spin_unlock_irqrestore(&dev_priv->stage_lock, flags);
+}
+
+/*
+ * Commit the staged writes of the CRTC. The device applies them together at
+ * the next retrace, at the cost of a single trap.
+ */
+void xengfx_crtc_flush(struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        unsigned long flags;
+
+        if (!dev_priv->stage)
+                return;
+
+        spin_lock_irqsave(&dev_priv->stage_lock, flags);
+        xengfx_crtc_flush_locked(dev_priv, crtc, 0);
+        spin_unlock_irqrestore(&dev_priv->stage_lock, flags);
+}
+
+/*
+ * Commit the staged writes of the CRTC and have the device apply them before
+ * the doorbell write returns, tearing if the CRTC is scanning out. Only
+ * available with stage blocks.
+ */
+void xengfx_crtc_flush_now(struct xengfx_crtc *crtc)
+{
+        struct xengfx_private *dev_priv = crtc->drm_crtc.dev->dev_private;
+        unsigned long flags;
+
+        if (WARN_ON(!dev_priv->stage))
+                return;
+
+        spin_lock_irqsave(&dev_priv->stage_lock, flags);
+        xengfx_crtc_flush_locked(dev_priv, crtc, XGFX_VCRTC_COMMIT_NOW);
+        spin_unlock_irqrestore(&dev_priv->stage_lock, flags);
+}
+
+int xengfx_stage_init(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        size_t size;
+
+        spin_lock_init(&dev_priv->stage_lock);
+
+        if (!(dev_priv->caps & XGFX_CAPS_STAGE) || !dev_priv->crtc_count)
+                return 0;
+
+        size = dev_priv->crtc_count * sizeof (struct xgfx_stage_block);
+        dev_priv->stage_pg = alloc_pages(GFP_KERNEL | __GFP_ZERO,
+                                         get_order(size));
+        if (!dev_priv->stage_pg)
+                return -ENOMEM;
+
+        dev_priv->stage = page_address(dev_priv->stage_pg);
+        xengfx_mmio_write(dev_priv, XGFX_STAGE_PAGE,
+                          page_to_pfn(dev_priv->stage_pg));
+
+        return 0;
+}
+
+/*
+ * The device forgets the blocks across suspend. Writes staged before are
+ * dropped: the register shadows were reset and the next modeset stages
+ * everything again.
+ */
+void xengfx_stage_resume(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        unsigned long flags;
+        int i;
+
+        if (!dev_priv->stage)
+                return;
+
+        spin_lock_irqsave(&dev_priv->stage_lock, flags);
+        for (i = 0; i < dev_priv->crtc_count; i++) {
+                if (dev_priv->crtcs[i])
+                        dev_priv->crtcs[i]->stage_count = 0;
+        }
+        xengfx_mmio_write(dev_priv, XGFX_STAGE_PAGE,
+                          page_to_pfn(dev_priv->stage_pg));
+        spin_unlock_irqrestore(&dev_priv->stage_lock, flags);
+}
+
+void xengfx_stage_fini(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+        size_t size;
+
+        if (!dev_priv->stage)
+                return;
+
+        xengfx_mmio_write(dev_priv, XGFX_STAGE_PAGE, 0);
+
+        size = dev_priv->crtc_count * sizeof (struct xgfx_stage_block);
+        __free_pages(dev_priv->stage_pg, get_order(size));
+        dev_priv->stage_pg = NULL;
+        dev_priv->stage = NULL;
+}
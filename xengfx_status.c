@@ -0,0 +1,127 @@
+/**************************************************************************
+ *
+ * Copyright (c) 2011 Citrix Systems, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Authors:
+ *    Julian Pidancet <julian.pidancet@gmail.com>
+ *
+ **************************************************************************/
+
+#include "drmP.h"
+#include "xengfx_drv.h"
+#include "xengfx_reg.h"
+
+/*
+ * Fetch and clear the pending interrupt bits. Returns 0 if the interrupt
+ * wasn't ours.
+ */
+u32 xengfx_status_fetch_isr(struct xengfx_private *dev_priv)
+{
+        return xchg(&dev_priv->status_page->isr, 0);
+}
+
+/* Fetch and clear the bitmap of CRTCs n * 32 to n * 32 + 31 with events */
+u32 xengfx_status_fetch_pending(struct xengfx_private *dev_priv, int n)
+{
+        return xchg(&dev_priv->status_page->pending[n], 0);
+}
+
+u32 xengfx_status_fetch_change(struct xengfx_private *dev_priv, int crtc,
+                               u32 *status)
+{
+        struct xgfx_status_crtc *crtc_status = &dev_priv->status_page->crtc[crtc];
+
+        *status = ACCESS_ONCE(crtc_status->status);
+
+        return xchg(&crtc_status->change, 0);
+}
+
+void xengfx_status_ack(struct xengfx_private *dev_priv)
+{
+        xengfx_mmio_write(dev_priv, XGFX_STATUS_ACK, 1);
+}
+
+u32 xengfx_status_scanline(struct xengfx_private *dev_priv, int crtc)
+{
+        if (dev_priv->status_page)
+                return ACCESS_ONCE(dev_priv->status_page->crtc[crtc].scanline);
+
+        return xengfx_mmio_read(dev_priv, XGFX_VCRTC(crtc, SCANLINE));
+}
+
+int xengfx_status_init(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        if (!(dev_priv->caps & XGFX_CAPS_STATUS_PAGE))
+                return 0;
+
+        if (dev_priv->crtc_count > XGFX_STATUS_PAGE_MAX_CRTCS) {
+                DRM_ERROR("Too many CRTCs for the status page\n");
+                return 0;
+        }
+
+        dev_priv->status_pg = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!dev_priv->status_pg)
+                return -ENOMEM;
+
+        dev_priv->status_page = page_address(dev_priv->status_pg);
+        dev_priv->status_page->version = XGFX_STATUS_PAGE_VERSION;
+        xengfx_mmio_write(dev_priv, XGFX_STATUS_PAGE,
+                          page_to_pfn(dev_priv->status_pg));
+
+        DRM_INFO("Using shared status page\n");
+
+        return 0;
+}
+
+/*
+ * The device forgets the page across suspend. Whatever it reported before
+ * is stale, clear the page and register it again.
+ */
+void xengfx_status_resume(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        if (!dev_priv->status_page)
+                return;
+
+        memset(dev_priv->status_page, 0, PAGE_SIZE);
+        dev_priv->status_page->version = XGFX_STATUS_PAGE_VERSION;
+        xengfx_mmio_write(dev_priv, XGFX_STATUS_PAGE,
+                          page_to_pfn(dev_priv->status_pg));
+}
+
+void xengfx_status_fini(struct drm_device *dev)
+{
+        struct xengfx_private *dev_priv = dev->dev_private;
+
+        if (!dev_priv->status_page)
+                return;
+
+        xengfx_mmio_write(dev_priv, XGFX_STATUS_PAGE, 0);
+
+        __free_page(dev_priv->status_pg);
+        dev_priv->status_pg = NULL;
+        dev_priv->status_page = NULL;
+}